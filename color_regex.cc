@@ -10,25 +10,211 @@ sudo tail -f /var/log/messages | ./color_regex --regex 'Sep  5 [[:digit:]]7:' --
 echo "abc" | ./color_regex a
 echo "abc" | ./color_regex a --whole_line
 
+Input is read with read(2) (or mmap(2) for regular files) instead of
+std::getline. Runs of non-matching lines are not copied into a
+std::string: for file input they are moved to stdout with
+copy_file_range(2)/splice(2), for pipe input they are written straight from
+the read buffer. Only matching lines go through the colorizer.
+
+--stats prints counters, time spent in regex/formatting/io and a histogram of
+per-line regex cost to stderr on exit and on SIGUSR1:
+sudo tail -f /var/log/messages | ./color_regex --stats error &
+kill -USR1 $!
+
+--json-field colors the values of the given keys in JSON lines, without regex
+and without building a DOM. Keys are matched at any nesting level. Lines where
+none of the keys is found fall back to the regex, if one is given:
+./service | ./color_regex --json-field level=red,trace_id=cyan
+./service | ./color_regex --json-field level --color green
+
+Patterns are matched by a lazy DFA built from the ERE (egrep) syntax, which
+runs in linear time, e.g. '(a|aa)*b' can not blow up on long lines of 'a's.
+Patterns it does not support (back references, \w etc.) are handed to
+std::regex. --engine std forces std::regex, which also colors subexpression
+matches; the dfa engine colors each whole match.
+
+Build with -DCOLOR_REGEX_TRACE to get USDT probes (needs sys/sdt.h), e.g.:
+perf probe -x ./color_regex sdt_color_regex:line
+
 */
 
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <regex>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <libaan/terminal.hh>
 
+#ifdef COLOR_REGEX_TRACE
+#include <sys/sdt.h>
+#define TRACE(name, ...) STAP_PROBEV(color_regex, name, __VA_ARGS__)
+#else
+#define TRACE(name, ...) do {} while(0)
+#endif
+
 namespace {
 struct opt_t {
     libaan::color_type color {libaan::RED};
     std::string regex;
     bool whole_line {false};
+    bool stats {false};
+    enum engine_t { AUTO, DFA, STD };
+    engine_t engine {AUTO};
+    // --json-field key[=color],...
+    std::vector<std::pair<std::string, libaan::color_type>> json_fields;
 };
 
+// Only touched if --stats is given, apart from the enabled check.
+struct stats_t {
+    typedef std::chrono::steady_clock clock;
+
+    // Regex cost above this is reported as pathological.
+    static constexpr uint64_t SLOW_NS = 1000000;
+    // Bucket i counts lines with regex cost in [2^i, 2^(i+1)) ns.
+    static constexpr size_t BUCKETS = 32;
+
+    bool enabled {false};
+    clock::time_point start;
+    uint64_t lines {0};
+    uint64_t bytes {0};
+    uint64_t matches {0};
+    uint64_t regex_ns {0};
+    uint64_t format_ns {0};
+    uint64_t io_ns {0};
+    uint64_t slow_lines {0};
+    uint64_t max_ns {0};
+    uint64_t max_line {0};
+    std::array<uint64_t, BUCKETS> hist {};
+
+    static uint64_t since(clock::time_point t)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   clock::now() - t).count();
+    }
+
+    void line(uint64_t ns)
+    {
+        hist[std::min<size_t>(ns ? 63 - __builtin_clzll(ns) : 0, BUCKETS - 1)]++;
+        if(ns > max_ns) {
+            max_ns = ns;
+            max_line = lines;
+        }
+        if(ns >= SLOW_NS)
+            slow_lines++;
+    }
+
+    void print() const
+    {
+        const auto total = since(start);
+        auto ms = [](uint64_t ns) { return ns / 1e6; };
+        fprintf(stderr,
+                "lines: %lu bytes: %lu matches: %lu (%.2f%%)\n"
+                "time: total %.3f ms regex %.3f ms format %.3f ms io %.3f ms\n"
+                "throughput: %.0f lines/s %.2f MB/s\n",
+                lines, bytes, matches,
+                lines ? 100.0 * matches / lines : 0.0, ms(total), ms(regex_ns),
+                ms(format_ns), ms(io_ns), total ? lines * 1e9 / total : 0.0,
+                total ? bytes * 1e3 / total : 0.0);
+        fprintf(stderr, "regex cost per line:\n");
+        for(size_t i = 0; i < BUCKETS; i++)
+            if(hist[i])
+                fprintf(stderr, "  < %12lu ns: %lu\n", 2ul << i, hist[i]);
+        if(slow_lines)
+            fprintf(stderr,
+                    "warning: %lu lines took >= %.1f ms in regex (max %.3f ms "
+                    "at line %lu). pattern might be pathological.\n",
+                    slow_lines, ms(SLOW_NS), ms(max_ns), max_line);
+    }
+};
+
+stats_t stats;
+std::atomic_bool sigusr1;
+
+void sighandler(int)
+{
+    sigusr1 = true;
+}
+
+void print_stats_if_requested()
+{
+    if(sigusr1.exchange(false))
+        stats.print();
+}
+
+// Adds the time spent in its scope to acc if --stats is active.
+struct scoped_timer_t {
+    explicit scoped_timer_t(uint64_t &acc)
+        : acc(stats.enabled ? &acc : nullptr)
+    {
+        if(this->acc)
+            start = stats_t::clock::now();
+    }
+    ~scoped_timer_t()
+    {
+        if(acc)
+            *acc += stats_t::since(start);
+    }
+
+    uint64_t *acc;
+    stats_t::clock::time_point start;
+};
+
+// "level=red,trace_id=cyan" -> {{"level", RED}, {"trace_id", CYAN}}
+// Fields without a color are added to uncolored, they get --color once
+// all arguments are known.
+bool parse_json_fields(const char *arg, opt_t &opts,
+                       std::vector<size_t> &uncolored)
+{
+    const std::string spec(arg);
+    size_t start = 0;
+    while(start <= spec.length()) {
+        auto end = spec.find(',', start);
+        if(end == std::string::npos)
+            end = spec.length();
+        const auto field = spec.substr(start, end - start);
+        const auto eq = field.find('=');
+        if(field.empty() || eq == 0)
+            return false;
+        if(eq == std::string::npos) {
+            uncolored.push_back(opts.json_fields.size());
+            opts.json_fields.emplace_back(field, opts.color);
+        } else
+            opts.json_fields.emplace_back(
+                field.substr(0, eq),
+                libaan::string_to_color(field.substr(eq + 1)));
+        start = end + 1;
+    }
+    return true;
+}
+
 std::pair<bool, opt_t> parse_args(int argc, char *argv[])
 {
     opt_t ret;
+    std::vector<size_t> uncolored;
     for(int i = 1; i < argc; i++) {
         if(strcmp(argv[i], "--color") == 0) {
             ++i;
@@ -46,6 +232,24 @@ std::pair<bool, opt_t> parse_args(int argc, char *argv[])
         //} else if(strcmp(argv[i], "--path") == 0) { ; //ret.regex.assign(<path_regex>);
         } else if(strcmp(argv[i], "--whole_line") == 0) {
             ret.whole_line = true;
+        } else if(strcmp(argv[i], "--stats") == 0) {
+            ret.stats = true;
+        } else if(strcmp(argv[i], "--engine") == 0) {
+            ++i;
+            if(i >= argc)
+                return std::make_pair(false, ret);
+            if(strcmp(argv[i], "dfa") == 0)
+                ret.engine = opt_t::DFA;
+            else if(strcmp(argv[i], "std") == 0)
+                ret.engine = opt_t::STD;
+            else
+                return std::make_pair(false, ret);
+        } else if(strcmp(argv[i], "--json-field") == 0) {
+            ++i;
+            if(i >= argc || !parse_json_fields(argv[i], ret, uncolored)) {
+                std::cerr << "invalid args: --json-field key[=color],...\n";
+                return std::make_pair(false, ret);
+            }
         } else {
             if(!ret.regex.empty())
                 std::cerr << "invalid args: only one of regex and pattern will be used.\n";
@@ -53,6 +257,8 @@ std::pair<bool, opt_t> parse_args(int argc, char *argv[])
         }
     }
 
+    for(const auto idx: uncolored)
+        ret.json_fields[idx].second = ret.color;
     return std::make_pair(true, ret);
 }
 
@@ -67,11 +273,9 @@ void replace(std::string& str, const std::string& from, const std::string& to)
     }
 }
 
-inline std::string colorize_if(std::string &&line, const std::regex &reg,
+inline std::string colorize_if(std::string &&line, const std::cmatch &match,
                                const opt_t &opts)
 {
-    std::smatch match;
-    std::regex_search(line, match, reg);
     // for(auto m: match) std::cout << "\"" << m << "\"\n";
 
     if(!match.empty()) {
@@ -84,15 +288,1340 @@ inline std::string colorize_if(std::string &&line, const std::regex &reg,
     return line;
 }
 
-bool run(const opt_t &opts)
+// Lazy DFA for the POSIX ERE subset accepted by std::regex_constants::egrep.
+// The pattern is parsed into a tree and compiled into Thompson NFAs, forward
+// and reversed. DFA states are sets of NFA states and are only built when a
+// transition is taken for the first time. The state cache is bounded. If it
+// has to be flushed too often, the line is matched by NFA simulation instead.
+// Either way matching is linear in the line length, there is no backtracking.
+namespace dfa {
+typedef std::bitset<256> charset_t;
+
+struct node_t {
+    enum type_t { SET, CAT, ALT, REPEAT, BOL, EOL, EMPTY };
+
+    explicit node_t(type_t type) : type(type), min(0), max(0) {}
+
+    type_t type;
+    charset_t set;
+    // REPEAT: max == -1 is unbounded
+    int min;
+    int max;
+    std::vector<std::unique_ptr<node_t>> sub;
+};
+typedef std::unique_ptr<node_t> node_ptr;
+
+// Recursive descent parser. Returns nullptr for invalid patterns and for
+// syntax handled only by std::regex (back references, escapes like \w,
+// collating elements), so the caller can fall back to it.
+class parser_t {
+public:
+    explicit parser_t(const std::string &re)
+        : p(re.c_str()), end(re.c_str() + re.length())
+    {
+    }
+
+    node_ptr parse()
+    {
+        auto n = alt();
+        if(!n || p != end)
+            return nullptr;
+        return n;
+    }
+
+private:
+    static node_ptr make(node_t::type_t type)
+    {
+        return node_ptr(new node_t(type));
+    }
+
+    node_ptr alt()
+    {
+        auto n = cat();
+        if(!n || p == end || *p != '|')
+            return n;
+        auto a = make(node_t::ALT);
+        a->sub.push_back(std::move(n));
+        while(p != end && *p == '|') {
+            ++p;
+            auto c = cat();
+            if(!c)
+                return nullptr;
+            a->sub.push_back(std::move(c));
+        }
+        return a;
+    }
+
+    node_ptr cat()
+    {
+        auto c = make(node_t::CAT);
+        while(p != end && *p != '|' && *p != ')') {
+            auto r = repeat();
+            if(!r)
+                return nullptr;
+            c->sub.push_back(std::move(r));
+        }
+        if(c->sub.empty())
+            return make(node_t::EMPTY);
+        if(c->sub.size() == 1)
+            return std::move(c->sub[0]);
+        return c;
+    }
+
+    node_ptr repeat()
+    {
+        auto n = atom();
+        while(n && p != end) {
+            int min, max;
+            if(*p == '*') {
+                min = 0;
+                max = -1;
+                ++p;
+            } else if(*p == '+') {
+                min = 1;
+                max = -1;
+                ++p;
+            } else if(*p == '?') {
+                min = 0;
+                max = 1;
+                ++p;
+            } else if(*p == '{' && p + 1 != end && isdigit(p[1])) {
+                if(!bounds(min, max))
+                    return nullptr;
+            } else {
+                break;
+            }
+            auto r = make(node_t::REPEAT);
+            r->min = min;
+            r->max = max;
+            r->sub.push_back(std::move(n));
+            n = std::move(r);
+        }
+        return n;
+    }
+
+    // {m}, {m,}, {m,n}
+    bool bounds(int &min, int &max)
+    {
+        ++p;
+        min = max = number();
+        if(p != end && *p == ',') {
+            ++p;
+            max = (p != end && isdigit(*p)) ? number() : -1;
+        }
+        if(p == end || *p != '}' || min > 1000
+           || (max != -1 && (max < min || max > 1000)))
+            return false;
+        ++p;
+        return true;
+    }
+
+    int number()
+    {
+        int v = 0;
+        while(p != end && isdigit(*p) && v <= 10000)
+            v = v * 10 + (*p++ - '0');
+        return v;
+    }
+
+    static node_ptr literal(unsigned char c)
+    {
+        auto n = make(node_t::SET);
+        n->set.set(c);
+        return n;
+    }
+
+    node_ptr atom()
+    {
+        const char c = *p++;
+        switch(c) {
+        case '(': {
+            auto n = alt();
+            if(!n || p == end || *p != ')')
+                return nullptr;
+            ++p;
+            return n;
+        }
+        case '[':
+            return bracket();
+        case '.': {
+            auto n = make(node_t::SET);
+            n->set.set();
+            n->set.reset('\n');
+            return n;
+        }
+        case '^':
+            return make(node_t::BOL);
+        case '$':
+            return make(node_t::EOL);
+        case '*':
+        case '+':
+        case '?':
+            return nullptr;
+        case '\\':
+            if(p == end || isalnum(*p))
+                return nullptr;
+            return literal(*p++);
+        default:
+            return literal(c);
+        }
+    }
+
+    static bool char_class(const std::string &name, charset_t &set)
+    {
+        static const std::pair<const char *, int (*)(int)> classes[] = {
+            {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+            {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+            {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+            {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit}};
+        for(const auto &c: classes) {
+            if(name != c.first)
+                continue;
+            for(int i = 0; i < 256; i++)
+                if(c.second(i))
+                    set.set(i);
+            return true;
+        }
+        return false;
+    }
+
+    node_ptr bracket()
+    {
+        auto n = make(node_t::SET);
+        bool neg = false;
+        if(p != end && *p == '^') {
+            neg = true;
+            ++p;
+        }
+        for(bool first = true; p != end && (*p != ']' || first); first = false) {
+            if(*p == '\\')
+                return nullptr;
+            if(*p == '[' && p + 1 != end && p[1] == ':') {
+                const char term[] = ":]";
+                const auto q = std::search(p + 2, end, term, term + 2);
+                if(q == end || !char_class(std::string(p + 2, q), n->set))
+                    return nullptr;
+                p = q + 2;
+                continue;
+            }
+            if(*p == '[' && p + 1 != end && (p[1] == '=' || p[1] == '.'))
+                return nullptr;
+            const unsigned char lo = *p++;
+            if(p + 1 < end && *p == '-' && p[1] != ']') {
+                const unsigned char hi = p[1];
+                p += 2;
+                if(hi < lo)
+                    return nullptr;
+                for(unsigned i = lo; i <= hi; i++)
+                    n->set.set(i);
+            } else {
+                n->set.set(lo);
+            }
+        }
+        if(p == end)
+            return nullptr;
+        ++p;
+        if(neg) {
+            n->set.flip();
+            n->set.reset('\n');
+        }
+        return n;
+    }
+
+    const char *p;
+    const char *end;
+};
+
+struct inst_t {
+    enum op_t { SET, SPLIT, BOL, EOL, MATCH };
+    op_t op;
+    int out;
+    int out1;
+    // SET: index into nfa_t::sets
+    int set;
+};
+
+// Assertions that hold at the current position.
+enum { AT_BEGIN = 1, AT_END = 2 };
+
+struct nfa_t {
+    enum { MAX_INSTS = 100000 };
+
+    // reverse: compile the reversed pattern, ^ and $ swap roles.
+    // unanchored: a match may start at any position.
+    bool compile(const node_t &root, bool reverse, bool unanchored)
+    {
+        this->reverse = reverse;
+        insts.clear();
+        sets.clear();
+        start = compile(root, emit(inst_t::MATCH, -1, -1));
+        if(unanchored) {
+            charset_t any;
+            any.set();
+            const auto loop = emit(inst_t::SPLIT, start, -1);
+            const auto self = emit_set(any, loop);
+            insts[loop].out1 = self;
+            start = loop;
+        }
+        if(insts.size() > MAX_INSTS)
+            return false;
+        classify();
+        return true;
+    }
+
+    // Adds the closure of inst i to set. SPLITs are followed, ^ and $ are
+    // resolved according to flags. An unresolved $ stays in the set, so it
+    // can be checked once the end of the line is reached.
+    void add(int i, unsigned flags, std::vector<int> &set)
+    {
+        stack.push_back(i);
+        while(!stack.empty()) {
+            i = stack.back();
+            stack.pop_back();
+            if(mark[i] == gen)
+                continue;
+            mark[i] = gen;
+            const auto &in = insts[i];
+            switch(in.op) {
+            case inst_t::SET:
+            case inst_t::MATCH:
+                set.push_back(i);
+                break;
+            case inst_t::SPLIT:
+                stack.push_back(in.out1);
+                stack.push_back(in.out);
+                break;
+            case inst_t::BOL:
+                if(flags & AT_BEGIN)
+                    stack.push_back(in.out);
+                break;
+            case inst_t::EOL:
+                if(flags & AT_END)
+                    stack.push_back(in.out);
+                else
+                    set.push_back(i);
+                break;
+            }
+        }
+    }
+
+    void begin_set(std::vector<int> &set)
+    {
+        set.clear();
+        if(++gen == 0) {
+            std::fill(mark.begin(), mark.end(), 0);
+            gen = 1;
+        }
+    }
+
+    void start_set(bool at_begin, std::vector<int> &set)
+    {
+        begin_set(set);
+        add(start, at_begin ? AT_BEGIN : 0, set);
+        std::sort(set.begin(), set.end());
+    }
+
+    void step(const std::vector<int> &from, unsigned char c,
+              std::vector<int> &to)
+    {
+        begin_set(to);
+        for(const auto i: from)
+            if(insts[i].op == inst_t::SET && sets[insts[i].set][c])
+                add(insts[i].out, 0, to);
+        std::sort(to.begin(), to.end());
+    }
+
+    bool accept(const std::vector<int> &set) const
+    {
+        for(const auto i: set)
+            if(insts[i].op == inst_t::MATCH)
+                return true;
+        return false;
+    }
+
+    // Whether an empty line matches, ^ and $ both hold at position 0.
+    bool accept_empty()
+    {
+        std::vector<int> set;
+        begin_set(set);
+        add(start, AT_BEGIN | AT_END, set);
+        return accept(set);
+    }
+
+    bool accept_at_end(const std::vector<int> &set)
+    {
+        std::vector<int> end;
+        begin_set(end);
+        for(const auto i: set)
+            if(insts[i].op == inst_t::EOL)
+                add(insts[i].out, AT_END, end);
+            else if(insts[i].op == inst_t::MATCH)
+                return true;
+        return accept(end);
+    }
+
+    std::vector<inst_t> insts;
+    std::vector<charset_t> sets;
+    int start;
+    // bytes that no SET can tell apart share a class
+    std::array<uint8_t, 256> classes;
+    int nclasses;
+
+private:
+    int emit(inst_t::op_t op, int out, int out1)
+    {
+        insts.push_back(inst_t {op, out, out1, -1});
+        mark.push_back(0);
+        return insts.size() - 1;
+    }
+
+    int emit_set(const charset_t &set, int out)
+    {
+        sets.push_back(set);
+        const auto i = emit(inst_t::SET, out, -1);
+        insts[i].set = sets.size() - 1;
+        return i;
+    }
+
+    // Compiles n so that it continues with next, returns the entry point.
+    int compile(const node_t &n, int next)
+    {
+        if(insts.size() > MAX_INSTS)
+            return next;
+        switch(n.type) {
+        case node_t::SET:
+            return emit_set(n.set, next);
+        case node_t::EMPTY:
+            return next;
+        case node_t::BOL:
+            return emit(reverse ? inst_t::EOL : inst_t::BOL, next, -1);
+        case node_t::EOL:
+            return emit(reverse ? inst_t::BOL : inst_t::EOL, next, -1);
+        case node_t::CAT:
+            if(reverse)
+                for(const auto &s: n.sub)
+                    next = compile(*s, next);
+            else
+                for(auto s = n.sub.rbegin(); s != n.sub.rend(); ++s)
+                    next = compile(**s, next);
+            return next;
+        case node_t::ALT: {
+            int entry = compile(*n.sub.back(), next);
+            for(auto s = n.sub.rbegin() + 1; s != n.sub.rend(); ++s)
+                entry = emit(inst_t::SPLIT, compile(**s, next), entry);
+            return entry;
+        }
+        case node_t::REPEAT: {
+            int entry = next;
+            if(n.max == -1) {
+                const auto loop = emit(inst_t::SPLIT, -1, next);
+                const auto body = compile(*n.sub[0], loop);
+                insts[loop].out = body;
+                entry = loop;
+            } else {
+                for(int i = n.min; i < n.max; i++)
+                    entry = emit(inst_t::SPLIT, compile(*n.sub[0], entry), next);
+            }
+            for(int i = 0; i < n.min; i++)
+                entry = compile(*n.sub[0], entry);
+            return entry;
+        }
+        }
+        return next;
+    }
+
+    void classify()
+    {
+        classes.fill(0);
+        nclasses = 1;
+        for(const auto &set: sets) {
+            std::map<std::pair<int, bool>, int> split;
+            for(int c = 0; c < 256; c++) {
+                const auto key = std::make_pair(int(classes[c]), bool(set[c]));
+                const auto it = split.find(key);
+                if(it == split.end()) {
+                    // size before the insert, in split[key] = split.size()
+                    // the order is only fixed since C++17
+                    const int id = split.size();
+                    split.emplace(key, id);
+                    classes[c] = id;
+                } else
+                    classes[c] = it->second;
+            }
+            nclasses = split.size();
+        }
+    }
+
+    bool reverse;
+    std::vector<unsigned> mark;
+    unsigned gen {0};
+    std::vector<int> stack;
+};
+
+// DFA built lazily on top of an nfa_t. State 0 is the dead state.
+class dfa_t {
+public:
+    enum { DEAD = 0 };
+
+    dfa_t(nfa_t &nfa, size_t max_states)
+        : thrashing(false), nfa(nfa), max_states(max_states), steps(0),
+          flushes(0)
+    {
+        flush();
+    }
+
+    int start(bool at_begin)
+    {
+        auto &s = starts[at_begin];
+        if(s == -1) {
+            nfa.start_set(at_begin, tmp);
+            s = insert(tmp);
+        }
+        return s;
+    }
+
+    int next(int s, unsigned char c)
+    {
+        steps++;
+        const auto t = trans[s * nfa.nclasses + nfa.classes[c]];
+        return t >= 0 ? t : slow_next(s, c);
+    }
+
+    bool accept(int s) const { return states[s].accept; }
+    bool accept_at_end(int s) const { return states[s].accept_at_end; }
+    bool accept_empty() const { return nfa.accept_empty(); }
+
+    // Changes whenever the cache is flushed. State ids from an older
+    // generation must not be used anymore.
+    size_t generation() const { return flushes; }
+
+    // Set if the cache was flushed shortly after the last flush. The
+    // caller should switch to nfa_sim_t then.
+    bool thrashing;
+
+private:
+    struct state_t {
+        std::vector<int> set;
+        bool accept;
+        bool accept_at_end;
+    };
+
+    int slow_next(int s, unsigned char c)
+    {
+        nfa.step(states[s].set, c, tmp);
+        const auto before = flushes;
+        const auto t = insert(tmp);
+        // if insert() flushed, s is gone
+        if(flushes == before)
+            trans[s * nfa.nclasses + nfa.classes[c]] = t;
+        return t;
+    }
+
+    int insert(const std::vector<int> &set)
+    {
+        const auto it = ids.find(set);
+        if(it != ids.end())
+            return it->second;
+        if(states.size() >= max_states) {
+            // fewer than 16 steps per cached state: not worth caching
+            thrashing = steps < 16 * max_states;
+            steps = 0;
+            flushes++;
+            flush();
+        }
+        const int id = states.size();
+        states.push_back(state_t {set, nfa.accept(set), nfa.accept_at_end(set)});
+        ids[set] = id;
+        trans.resize(trans.size() + nfa.nclasses, -1);
+        return id;
+    }
+
+    void flush()
+    {
+        states.clear();
+        ids.clear();
+        trans.assign(nfa.nclasses, DEAD);
+        states.push_back(state_t {std::vector<int>(), false, false});
+        ids[states[0].set] = DEAD;
+        starts[0] = starts[1] = -1;
+    }
+
+    nfa_t &nfa;
+    size_t max_states;
+    size_t steps;
+    size_t flushes;
+    std::vector<state_t> states;
+    std::map<std::vector<int>, int> ids;
+    std::vector<int> trans;
+    int starts[2];
+    std::vector<int> tmp;
+};
+
+// Same interface as dfa_t, but nothing is cached. Only one state is alive at
+// a time, which is all the scan functions below need.
+class nfa_sim_t {
+public:
+    enum { DEAD = 0 };
+
+    explicit nfa_sim_t(nfa_t &nfa) : thrashing(false), nfa(nfa) {}
+
+    int start(bool at_begin)
+    {
+        nfa.start_set(at_begin, cur);
+        return cur.empty() ? DEAD : 1;
+    }
+
+    int next(int, unsigned char c)
+    {
+        nfa.step(cur, c, tmp);
+        cur.swap(tmp);
+        return cur.empty() ? DEAD : 1;
+    }
+
+    bool accept(int) const { return nfa.accept(cur); }
+    bool accept_at_end(int) const { return nfa.accept_at_end(cur); }
+    bool accept_empty() const { return nfa.accept_empty(); }
+
+    const bool thrashing;
+
+private:
+    nfa_t &nfa;
+    std::vector<int> cur;
+    std::vector<int> tmp;
+};
+
+enum { ABORT = -2 };
+
+// 1 if there is a match in [0, len), 0 if not, ABORT if the engine thrashes.
+template<typename engine_t>
+int has_match(engine_t &m, const unsigned char *text, size_t len)
+{
+    if(!len)
+        return m.accept_empty();
+    auto s = m.start(true);
+    for(size_t i = 0; i < len; i++) {
+        if(m.accept(s))
+            return 1;
+        s = m.next(s, text[i]);
+        if(m.thrashing)
+            return ABORT;
+        if(s == engine_t::DEAD)
+            return 0;
+    }
+    return m.accept(s) || m.accept_at_end(s);
+}
+
+// Scans backwards with the reversed pattern and marks every position where
+// a match starts.
+template<typename engine_t>
+int match_starts(engine_t &m, const unsigned char *text, size_t len,
+                 std::vector<bool> &starts)
+{
+    starts.assign(len + 1, false);
+    if(!len) {
+        starts[0] = m.accept_empty();
+        return 0;
+    }
+    auto s = m.start(true);
+    starts[len] = m.accept(s);
+    for(size_t i = len; i > 0; i--) {
+        s = m.next(s, text[i - 1]);
+        if(m.thrashing)
+            return ABORT;
+        if(s == engine_t::DEAD)
+            return 0;
+        starts[i - 1] = m.accept(s);
+    }
+    starts[0] = starts[0] || m.accept_at_end(s);
+    return 0;
+}
+
+// End of the longest match starting at pos, -1 if there is none.
+template<typename engine_t>
+long longest_match(engine_t &m, const unsigned char *text, size_t len,
+                   size_t pos)
+{
+    if(!len)
+        return m.accept_empty() ? 0 : -1;
+    auto s = m.start(pos == 0);
+    long best = m.accept(s) ? pos : -1;
+    for(size_t i = pos; i < len; i++) {
+        s = m.next(s, text[i]);
+        if(m.thrashing)
+            return ABORT;
+        if(s == engine_t::DEAD)
+            return best;
+        if(m.accept(s))
+            best = i + 1;
+    }
+    return m.accept_at_end(s) ? long(len) : best;
+}
+
+// Remembers for each (position, dfa state) pair that longest_match() walked
+// through the last match end after that position, -1 if there is none. The
+// rest of a run only depends on the pair, so a later run reaching the same
+// pair can stop there. Without this, a pattern like 'a*b|a' rescans the
+// whole line from every start.
+struct memo_t {
+    // Runs shorter than this are cheap enough without the memo.
+    enum { MIN_RUN = 64 };
+
+    static uint64_t key(size_t i, int s) { return uint64_t(i) << 32 | s; }
+
+    void clear(size_t gen)
+    {
+        ends.clear();
+        generation = gen;
+    }
+
+    std::unordered_map<uint64_t, long> ends;
+    std::vector<int> path;
+    size_t generation;
+};
+
+// Same as above, but uses and fills memo. Each pair is walked at most once,
+// so all runs of one line together are linear in len.
+inline long longest_match(dfa_t &m, const unsigned char *text, size_t len,
+                          size_t pos, memo_t &memo)
+{
+    if(!len)
+        return m.accept_empty() ? 0 : -1;
+    if(memo.generation != m.generation())
+        memo.clear(m.generation());
+    auto s = m.start(pos == 0);
+    long best = m.accept(s) ? pos : -1;
+    long tail = -1;
+    // positions [first, i) of this run are in memo.path
+    const size_t first = pos + memo_t::MIN_RUN;
+    bool record = true;
+    memo.path.clear();
+    size_t i = pos;
+    for(; i < len; i++) {
+        if(i >= first && record) {
+            const auto it = memo.ends.find(memo_t::key(i, s));
+            if(it != memo.ends.end()) {
+                tail = it->second;
+                break;
+            }
+            memo.path.push_back(s);
+        }
+        s = m.next(s, text[i]);
+        if(m.thrashing)
+            return ABORT;
+        if(memo.generation != m.generation()) {
+            // the ids in path are gone
+            memo.clear(m.generation());
+            record = false;
+        }
+        if(s == dfa_t::DEAD)
+            break;
+        if(m.accept(s))
+            best = i + 1;
+    }
+    const bool at_end = i == len && (m.accept(s) || m.accept_at_end(s));
+    if(at_end)
+        best = len;
+
+    if(record) {
+        // walk back from the last state and fill in the pairs of this run
+        long end = tail >= 0 ? tail : (at_end ? long(len) : -1);
+        auto next = s;
+        for(size_t k = memo.path.size(); k > 0; k--) {
+            const auto at = first + k;
+            if(end < 0 && m.accept(next))
+                end = at;
+            memo.ends[memo_t::key(at - 1, memo.path[k - 1])] = end;
+            next = memo.path[k - 1];
+        }
+    }
+    return tail >= 0 ? tail : best;
+}
+
+class regex_t {
+public:
+    enum { MAX_STATES = 4096 };
+
+    // Returns false if the pattern is not supported, see parser_t.
+    bool compile(const std::string &re)
+    {
+        const auto root = parser_t(re).parse();
+        if(!root || !search_nfa.compile(*root, false, true)
+           || !anchored_nfa.compile(*root, false, false)
+           || !reverse_nfa.compile(*root, true, true))
+            return false;
+        search_dfa.reset(new dfa_t(search_nfa, MAX_STATES));
+        anchored_dfa.reset(new dfa_t(anchored_nfa, MAX_STATES));
+        reverse_dfa.reset(new dfa_t(reverse_nfa, MAX_STATES));
+        return true;
+    }
+
+    bool search(const char *begin, const char *end)
+    {
+        const auto text = reinterpret_cast<const unsigned char *>(begin);
+        const size_t len = end - begin;
+        search_dfa->thrashing = false;
+        const auto ret = has_match(*search_dfa, text, len);
+        if(ret != ABORT)
+            return ret;
+        nfa_sim_t sim(search_nfa);
+        return has_match(sim, text, len);
+    }
+
+    // Calls cb(begin, end) for each non-overlapping leftmost-longest match.
+    template<typename lambda_t>
+    void foreach_match(const char *begin, const char *end, lambda_t cb)
+    {
+        const auto text = reinterpret_cast<const unsigned char *>(begin);
+        const size_t len = end - begin;
+        reverse_dfa->thrashing = false;
+        if(match_starts(*reverse_dfa, text, len, starts) == ABORT) {
+            nfa_sim_t sim(reverse_nfa);
+            match_starts(sim, text, len, starts);
+        }
+        memo.clear(anchored_dfa->generation());
+        for(size_t pos = 0; pos <= len; pos++) {
+            if(!starts[pos])
+                continue;
+            anchored_dfa->thrashing = false;
+            auto e = longest_match(*anchored_dfa, text, len, pos, memo);
+            if(e == ABORT) {
+                nfa_sim_t sim(anchored_nfa);
+                e = longest_match(sim, text, len, pos);
+            }
+            if(e < 0 || size_t(e) == pos)
+                continue;
+            cb(pos, size_t(e));
+            pos = e - 1;
+        }
+    }
+
+private:
+    nfa_t search_nfa;
+    nfa_t anchored_nfa;
+    nfa_t reverse_nfa;
+    std::unique_ptr<dfa_t> search_dfa;
+    std::unique_ptr<dfa_t> anchored_dfa;
+    std::unique_ptr<dfa_t> reverse_dfa;
+    std::vector<bool> starts;
+    memo_t memo;
+};
+}
+
+// Uses dfa::regex_t unless --engine std is given or the pattern is not
+// supported by it.
+struct regex_matcher_t {
+    regex_matcher_t(const opt_t &opts)
+        : opts(opts), use_dfa(false)
+    {
+        if(opts.engine != opt_t::STD) {
+            use_dfa = dfa.compile(opts.regex);
+            if(!use_dfa && opts.engine == opt_t::DFA)
+                std::cerr << "pattern not supported by dfa engine, "
+                             "using std::regex\n";
+        }
+        if(!use_dfa)
+            reg.assign(opts.regex, std::regex_constants::egrep);
+    }
+
+    bool search(const char *begin, const char *end)
+    {
+        if(use_dfa)
+            return dfa.search(begin, end);
+        return std::regex_search(begin, end, match, reg);
+    }
+
+    void format(const char *begin, const char *end, std::string &dst)
+    {
+        if(!use_dfa) {
+            dst.append(colorize_if(std::string(begin, end), match, opts));
+            return;
+        }
+        if(opts.whole_line) {
+            dst.append(libaan::colorize(opts.color, std::string(begin, end)));
+            return;
+        }
+        size_t prev = 0;
+        dfa.foreach_match(begin, end, [&](size_t b, size_t e) {
+            dst.append(begin + prev, b - prev);
+            dst.append(libaan::colorize(opts.color, std::string(begin + b, begin + e)));
+            prev = e;
+        });
+        dst.append(begin + prev, end - begin - prev);
+    }
+
+    const opt_t &opts;
+    bool use_dfa;
+    dfa::regex_t dfa;
+    std::regex reg;
+    std::cmatch match;
+};
+
+// Structural scanner for JSON lines in the style of simdjson: each 64 byte
+// block is turned into bitmasks of quotes, backslashes and {}[]:, outside of
+// strings. Only the set bits are visited to find keys and value spans.
+namespace json {
+struct block_t {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op;
+};
+
+inline void classify(const char *p, block_t &b)
+{
+#ifdef __SSE2__
+    b.quote = b.backslash = b.op = 0;
+    for(int i = 0; i < 4; i++) {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i * 16));
+        auto eq = [&v](char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); };
+        const uint64_t q = uint16_t(_mm_movemask_epi8(eq('"')));
+        const uint64_t bs = uint16_t(_mm_movemask_epi8(eq('\\')));
+        // '{' '}' and '[' ']' differ only in bit 0x20 from each other
+        const auto v20 = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        const auto ops = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v20, _mm_set1_epi8('{')),
+                         _mm_cmpeq_epi8(v20, _mm_set1_epi8('}'))),
+            _mm_or_si128(eq(':'), eq(',')));
+        const uint64_t o = uint16_t(_mm_movemask_epi8(ops));
+        b.quote |= q << (i * 16);
+        b.backslash |= bs << (i * 16);
+        b.op |= o << (i * 16);
+    }
+#else
+    b.quote = b.backslash = b.op = 0;
+    for(int i = 0; i < 64; i++) {
+        const uint64_t bit = 1ull << i;
+        switch(p[i]) {
+        case '"': b.quote |= bit; break;
+        case '\\': b.backslash |= bit; break;
+        case '{': case '}': case '[': case ']': case ':': case ',':
+            b.op |= bit;
+            break;
+        }
+    }
+#endif
+}
+
+// Bits of characters escaped by an odd number of preceding backslashes.
+// prev_escaped carries over into the next block.
+inline uint64_t escaped(uint64_t backslash, uint64_t &prev_escaped)
+{
+    const uint64_t even_bits = 0x5555555555555555ull;
+    backslash &= ~prev_escaped;
+    const uint64_t follows_escape = backslash << 1 | prev_escaped;
+    const uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t even_starts;
+    prev_escaped = __builtin_add_overflow(odd_starts, backslash, &even_starts);
+    const uint64_t invert_mask = even_starts << 1;
+    return (even_bits ^ invert_mask) & follows_escape;
+}
+
+inline uint64_t prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// The four whitespace bytes of JSON. isspace() depends on the locale and
+// is undefined for the negative chars of UTF-8 text.
+inline bool is_ws(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+struct span_t {
+    size_t begin;
+    size_t end;
+    libaan::color_type color;
+};
+
+// Appends spans of values whose key is in fields. Nested matches inside of
+// an already matched value are ignored, so spans never overlap.
+template<typename fields_t>
+void scan(const char *line, size_t len, const fields_t &fields,
+          std::vector<span_t> &spans)
+{
+    enum { MAX_DEPTH = 64 };
+    bool is_obj[MAX_DEPTH + 1];
+    size_t depth = 0;
+    is_obj[0] = false;
+
+    bool in_str = false;
+    bool expect_key = false;
+    size_t str_begin = 0;
+    size_t key_begin = 0, key_end = 0;
+    bool have_key = false;
+
+    bool pending = false;
+    size_t pending_depth = 0;
+    span_t cur {0, 0, libaan::RED};
+
+    auto end_value = [&](size_t pos) {
+        while(cur.begin < pos && is_ws(line[cur.begin]))
+            cur.begin++;
+        while(pos > cur.begin && is_ws(line[pos - 1]))
+            pos--;
+        cur.end = pos;
+        if(cur.end > cur.begin)
+            spans.push_back(cur);
+        pending = false;
+    };
+
+    uint64_t prev_escaped = 0;
+    uint64_t prev_in_string = 0;
+    char tail[64];
+    for(size_t off = 0; off < len; off += 64) {
+        const char *p = line + off;
+        if(len - off < 64) {
+            memset(tail, ' ', sizeof tail);
+            memcpy(tail, p, len - off);
+            p = tail;
+        }
+        block_t b;
+        classify(p, b);
+        const uint64_t quote = b.quote & ~escaped(b.backslash, prev_escaped);
+        const uint64_t in_string = prefix_xor(quote) ^ prev_in_string;
+        prev_in_string = uint64_t(int64_t(in_string) >> 63);
+
+        for(uint64_t bits = quote | (b.op & ~in_string); bits;
+            bits &= bits - 1) {
+            const size_t pos = off + __builtin_ctzll(bits);
+            const char c = line[pos];
+            if(c == '"') {
+                if(!in_str) {
+                    str_begin = pos + 1;
+                } else if(expect_key && depth <= MAX_DEPTH && is_obj[depth]) {
+                    key_begin = str_begin;
+                    key_end = pos;
+                    have_key = true;
+                    expect_key = false;
+                }
+                in_str = !in_str;
+                continue;
+            }
+
+            switch(c) {
+            case '{':
+            case '[':
+                if(depth < MAX_DEPTH)
+                    is_obj[++depth] = c == '{';
+                else
+                    depth++;
+                expect_key = c == '{' && depth <= MAX_DEPTH;
+                have_key = false;
+                break;
+            case '}':
+            case ']':
+                if(pending && pending_depth == depth)
+                    end_value(pos);
+                if(depth)
+                    depth--;
+                expect_key = false;
+                break;
+            case ',':
+                if(pending && pending_depth == depth)
+                    end_value(pos);
+                expect_key = depth <= MAX_DEPTH && is_obj[depth];
+                have_key = false;
+                break;
+            case ':':
+                if(have_key && !pending) {
+                    const size_t klen = key_end - key_begin;
+                    for(const auto &f: fields) {
+                        if(f.first.length() == klen
+                           && memcmp(f.first.data(), line + key_begin, klen)
+                                  == 0) {
+                            pending = true;
+                            pending_depth = depth;
+                            cur.begin = pos + 1;
+                            cur.color = f.second;
+                            break;
+                        }
+                    }
+                }
+                have_key = false;
+                break;
+            }
+        }
+    }
+    if(pending)
+        end_value(len);
+}
+}
+
+// Colors values of --json-field keys, falls back to the regex if the line has
+// none of them and a regex was given.
+struct json_matcher_t {
+    json_matcher_t(const opt_t &opts)
+        : opts(opts), fallback(nullptr)
+    {
+        if(!opts.regex.empty())
+            fallback.reset(new regex_matcher_t(opts));
+    }
+
+    bool search(const char *begin, const char *end)
+    {
+        spans.clear();
+        use_fallback = false;
+        json::scan(begin, end - begin, opts.json_fields, spans);
+        if(!spans.empty())
+            return true;
+        use_fallback = fallback && fallback->search(begin, end);
+        return use_fallback;
+    }
+
+    void format(const char *begin, const char *end, std::string &dst)
+    {
+        if(use_fallback)
+            return fallback->format(begin, end, dst);
+        if(opts.whole_line) {
+            dst.append(libaan::colorize(spans[0].color, std::string(begin, end)));
+            return;
+        }
+        size_t prev = 0;
+        for(const auto &s: spans) {
+            dst.append(begin + prev, s.begin - prev);
+            dst.append(libaan::colorize(
+                s.color, std::string(begin + s.begin, begin + s.end)));
+            prev = s.end;
+        }
+        dst.append(begin + prev, end - begin - prev);
+    }
+
+    const opt_t &opts;
+    std::unique_ptr<regex_matcher_t> fallback;
+    bool use_fallback {false};
+    std::vector<json::span_t> spans;
+};
+
+bool write_all(int fd, const char *data, size_t len)
+{
+    while(len) {
+        scoped_timer_t t(stats.io_ns);
+        const auto w = write(fd, data, len);
+        if(w == -1) {
+            if(errno == EINTR)
+                continue;
+            perror("write");
+            return false;
+        }
+        data += w;
+        len -= w;
+    }
+    return true;
+}
+
+// Writes colorized lines and passes unmodified input through to stdout.
+// Colorized lines are collected in pending and written in one go before the
+// next passthrough run to keep the output in order.
+struct output_t {
+    enum mode_t { WRITE, COPY_FILE_RANGE, SPLICE };
+
+    explicit output_t(int in_fd)
+        : in_fd(in_fd), out_fd(STDOUT_FILENO), mode(WRITE)
+    {
+        struct stat in, out;
+        if(fstat(in_fd, &in) == -1 || fstat(out_fd, &out) == -1
+           || !S_ISREG(in.st_mode))
+            return;
+        if(S_ISREG(out.st_mode))
+            mode = COPY_FILE_RANGE;
+        else if(S_ISFIFO(out.st_mode))
+            mode = SPLICE;
+    }
+
+    ~output_t() { flush(); }
+
+    void append(const std::string &s) { pending.append(s); }
+    std::string &buffer() { return pending; }
+
+    bool flush()
+    {
+        if(pending.empty())
+            return true;
+        const auto ret = write_all(out_fd, pending.data(), pending.size());
+        pending.clear();
+        return ret;
+    }
+
+    // data/len: input bytes as seen in user space.
+    // in_off: offset of data in in_fd or -1 if in_fd is not seekable.
+    bool passthrough(const char *data, size_t len, off_t in_off)
+    {
+        if(!len)
+            return true;
+        if(!flush())
+            return false;
+        if(in_off != -1 && mode != WRITE) {
+            loff_t off = in_off;
+            scoped_timer_t t(stats.io_ns);
+            while(len) {
+                const auto w = mode == COPY_FILE_RANGE
+                    ? copy_file_range(in_fd, &off, out_fd, nullptr, len, 0)
+                    : splice(in_fd, &off, out_fd, nullptr, len, SPLICE_F_MOVE);
+                if(w == -1 && errno == EINTR)
+                    continue;
+                if(w <= 0) {
+                    // e.g. EXDEV, EINVAL: fall back to write(2)
+                    mode = WRITE;
+                    break;
+                }
+                data += w;
+                len -= w;
+            }
+            if(!len)
+                return true;
+        }
+        return write_all(out_fd, data, len);
+    }
+
+    int in_fd;
+    int out_fd;
+    mode_t mode;
+    std::string pending;
+};
+
+// Process all complete lines in [begin, end). If last is set, a trailing line
+// without newline is processed too. base is the file offset of begin or -1.
+// Returns the number of bytes consumed.
+template<typename matcher_t>
+size_t process_lines(const char *begin, const char *end, off_t base, bool last,
+                     matcher_t &matcher, output_t &out)
 {
-    std::regex reg(opts.regex, std::regex_constants::egrep);
-    std::string line;
-    while(std::getline(std::cin, line))
-        std::cout << colorize_if(std::move(line), reg, opts) << "\n";
+    const char *run = begin;
+    const char *line = begin;
+    while(line < end) {
+        auto eol = static_cast<const char *>(memchr(line, '\n', end - line));
+        if(!eol) {
+            if(!last)
+                break;
+            eol = end;
+        }
 
+        bool found;
+        if(stats.enabled) {
+            const auto t = stats_t::clock::now();
+            found = matcher.search(line, eol);
+            const auto ns = stats_t::since(t);
+            stats.regex_ns += ns;
+            stats.lines++;
+            // the newline, if the last line has one
+            stats.bytes += eol - line + (eol < end);
+            stats.line(ns);
+            if((stats.lines & 0xfff) == 0)
+                print_stats_if_requested();
+        } else {
+            found = matcher.search(line, eol);
+        }
+        TRACE(line, eol - line, found);
+
+        if(found) {
+            out.passthrough(run, line - run,
+                            base == -1 ? -1 : base + (run - begin));
+            {
+                scoped_timer_t t(stats.format_ns);
+                matcher.format(line, eol, out.buffer());
+                out.append("\n");
+            }
+            stats.matches++;
+            run = eol + 1;
+        } else if(eol == end) {
+            out.passthrough(run, eol - run,
+                            base == -1 ? -1 : base + (run - begin));
+            out.append("\n");
+            run = eol + 1;
+        }
+        line = eol + 1;
+    }
+    if(run < line) {
+        const auto stop = std::min(line, end);
+        out.passthrough(run, stop - run, base == -1 ? -1 : base + (run - begin));
+    }
+    return std::min(line, end) - begin;
+}
+
+template<typename matcher_t>
+bool run_mmap(int fd, size_t size, matcher_t &matcher)
+{
+    // stdin may have been partially consumed by the parent
+    auto start = lseek(fd, 0, SEEK_CUR);
+    if(start == -1)
+        start = 0;
+    if(size_t(start) >= size)
+        return true;
+    auto map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char *data = static_cast<const char *>(map);
+    output_t out(fd);
+    process_lines(data + start, data + size, start, true, matcher, out);
+    out.flush();
+    munmap(map, size);
     return true;
 }
+
+template<typename matcher_t>
+bool run_stream(int fd, matcher_t &matcher)
+{
+    std::vector<char> buf(1 << 20);
+    size_t fill = 0;
+    output_t out(fd);
+    while(true) {
+        if(fill == buf.size())
+            buf.resize(buf.size() * 2);
+        ssize_t r;
+        {
+            scoped_timer_t t(stats.io_ns);
+            r = read(fd, buf.data() + fill, buf.size() - fill);
+        }
+        TRACE(read, r);
+        if(r == -1) {
+            if(errno == EINTR) {
+                print_stats_if_requested();
+                continue;
+            }
+            perror("read");
+            return false;
+        }
+        fill += r;
+        const auto used = process_lines(buf.data(), buf.data() + fill, -1,
+                                        r == 0, matcher, out);
+        out.flush();
+        print_stats_if_requested();
+        fill -= used;
+        if(fill)
+            memmove(buf.data(), buf.data() + used, fill);
+        if(r == 0)
+            return true;
+    }
+}
+
+template<typename matcher_t>
+bool run(matcher_t &matcher)
+{
+    struct stat s;
+    if(fstat(STDIN_FILENO, &s) == 0 && S_ISREG(s.st_mode) && s.st_size > 0)
+        return run_mmap(STDIN_FILENO, s.st_size, matcher);
+    return run_stream(STDIN_FILENO, matcher);
+}
+
+bool run(const opt_t &opts)
+{
+    if(!opts.json_fields.empty()) {
+        json_matcher_t matcher(opts);
+        return run(matcher);
+    }
+    regex_matcher_t matcher(opts);
+    return run(matcher);
+}
 }
 
 int main(int argc, char *argv[])
@@ -101,5 +1630,22 @@ int main(int argc, char *argv[])
     if(!opts.first)
         return -1;
 
-    return run(opts.second) ? 0 : -1;
+    if(opts.second.stats) {
+        stats.enabled = true;
+        stats.start = stats_t::clock::now();
+
+        // no SA_RESTART: a blocking read(2) returns EINTR and stats are
+        // printed right away
+        struct sigaction sa;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_handler = sighandler;
+        sa.sa_flags = 0;
+        if(sigaction(SIGUSR1, &sa, NULL) == -1)
+            perror("sigaction");
+    }
+
+    const auto ret = run(opts.second);
+    if(stats.enabled)
+        stats.print();
+    return ret ? 0 : -1;
 }
@@ -13,29 +13,85 @@ sprop-parameter-sets=Z0KAHoxoEBM/8AAQABAI,aM4EYg==
 ./h264_sprop_parameter_sets sprop-parameter-sets=Z0KAHoxoEBM/8AAQABAI,aM4EYg==
 sps "67 42 80 1e 8c 68 10 13 3f f0 0 10 0 10 8 "
 pps "68 ce 4 62 "
+sps 0: Baseline profile (66), constraints 0x80, level 3.0
+  256x144p, 16x9 macroblocks
+  4:2:0 8 bit, poc type 2, max ref frames 1
+  sar 1:1
+pps 0: sps 0, CAVLC, ref idx 1/1, init qp 30
 
+Long recordings repeat the same parameter sets with every GOP:
+./h264_sprop_parameter_sets --unique $file
+prints each distinct SPS/PPS pair once, when it first occurs or the
+stream switches to it, and a table with offsets and counts at the end.
+
+MP4/MOV files are recognized by their first box. The parameter sets are
+taken from the avcC box of each video track, the samples are not read.
+
+pcap and pcapng captures of RTP over UDP are depacketized (single NAL
+units, STAP-A, FU-A). The first stream sending a SPS is followed unless
+--ssrc is given, --port limits the search to one UDP port.
+
+--stats prints a NAL type histogram, slice type counts, the IDR
+interval and GOP length distribution, NALU sizes and the bitrate per
+second of stream time instead.
+
+--index <file> writes a NAL unit index of an Annex B stream instead:
+./h264_sprop_parameter_sets --index $file.idx $file
+./h264_sprop_parameter_sets lookup $file.idx idr 10
+finds IDR picture 10 and the SPS before it without reading $file. IDR
+pictures and NAL units are counted from 0, idr 0 is the first one.
+"sps <offset>" looks up the SPS in effect at offset, "nal <n>" NAL unit
+n.
+
+--extract <out> cuts a mapped Annex B file without reading the payload,
+with copy_file_range or splice:
+./h264_sprop_parameter_sets --extract idr.h264 --types 5 $file
+./h264_sprop_parameter_sets --extract first10.h264 --seconds 0-10 $file
+./h264_sprop_parameter_sets --extract - --bytes 1000000- $file | ffplay -
+The cut starts with the SPS and PPS in effect, which also go to
+<out>.sprop. --types always keeps SPS and PPS, --seconds starts at the
+first IDR picture in the range.
+
+--threads <n> scans a mapped file in n ranges at once (0: one per cpu),
+the output is the same as with one thread.
+
+Parameter sets are decoded in tree, without GStreamer or OpenSSL. Build
+with -DUSE_GST for --gst, which scans the file with the GStreamer NALU
+parser instead.
 */
 
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#ifdef USE_GST
 extern "C" {
 #include <gst/codecparsers/gsth264parser.h>
 }
+#endif
 
 #include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <functional>
+#include <map>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-#include <openssl/bio.h>
-#include <openssl/buffer.h>
-#include <openssl/evp.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <libaan/string.hh>
 
@@ -51,74 +107,563 @@ const std::vector<std::string> sprops_ex = {
 };
 #endif
 
+// Base64 without line breaks, RFC 4648 alphabet. Decoding stops at the
+// first character outside of it, '=' included.
 size_t base64decode(const void* in, const size_t in_len, char* out, const size_t out_len)
 {
-    BIO *b64 = BIO_new(BIO_f_base64());
-    BIO *mem = BIO_new(BIO_s_mem());
-    const auto w = BIO_write(mem, in, in_len);
-    assert(w > 0 && (size_t)w == in_len);
-    BIO_push(b64, mem);
-    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-    const auto r = BIO_read(b64, out, out_len);
-    BIO_free_all(b64);
-    return r > 0 ? r : 0;
+    const unsigned char *p = static_cast<const unsigned char *>(in);
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t r = 0;
+    for(size_t i = 0; i < in_len && r < out_len; i++) {
+        const unsigned char c = p[i];
+        int v;
+        if(c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if(c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if(c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if(c == '+')
+            v = 62;
+        else if(c == '/')
+            v = 63;
+        else
+            break;
+        acc = acc << 6 | v;
+        bits += 6;
+        if(bits >= 8) {
+            bits -= 8;
+            out[r++] = char(acc >> bits);
+        }
+    }
+    return r;
 }
 
 size_t base64encode(const void* in, const size_t in_len, char* out, const size_t out_len)
 {
-    BIO *b64 = BIO_new(BIO_f_base64());
-    BIO *mem = BIO_new(BIO_s_mem());
-    mem = BIO_push(b64, mem);
-    BIO_set_flags(mem, BIO_FLAGS_BASE64_NO_NL);
-    const auto w = BIO_write(mem, in, in_len);
-    assert(w > 0 && (size_t)w == in_len);
-    (void)BIO_flush(mem);
+    static const char ALPHABET[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = static_cast<const unsigned char *>(in);
+    size_t r = 0;
+    for(size_t i = 0; i < in_len && r + 4 <= out_len; i += 3) {
+        const uint32_t n = p[i] << 16 | (i + 1 < in_len ? p[i + 1] << 8 : 0)
+            | (i + 2 < in_len ? p[i + 2] : 0);
+        out[r++] = ALPHABET[n >> 18];
+        out[r++] = ALPHABET[n >> 12 & 63];
+        out[r++] = i + 1 < in_len ? ALPHABET[n >> 6 & 63] : '=';
+        out[r++] = i + 2 < in_len ? ALPHABET[n & 63] : '=';
+    }
+    return r;
+}
+
+// SPS and PPS decoding, enough to print what a stream is configured for.
+namespace h264 {
+
+enum : unsigned { NAL_SPS = 7, NAL_PPS = 8, NAL_AUD = 9 };
+
+// Removes emulation prevention: 00 00 03 -> 00 00.
+inline std::vector<unsigned char> unescape(const unsigned char *data, size_t size)
+{
+    std::vector<unsigned char> rbsp;
+    rbsp.reserve(size);
+    unsigned zeros = 0;
+    for(size_t i = 0; i < size; i++) {
+        if(zeros >= 2 && data[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = data[i] ? 0 : zeros + 1;
+        rbsp.push_back(data[i]);
+    }
+    return rbsp;
+}
+
+// Same into out, up to out_size bytes: enough for a slice header without
+// touching the heap. Returns the RBSP length.
+inline size_t unescape(const unsigned char *data, size_t size,
+                       unsigned char *out, size_t out_size)
+{
+    size_t n = 0;
+    unsigned zeros = 0;
+    for(size_t i = 0; i < size && n < out_size; i++) {
+        if(zeros >= 2 && data[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = data[i] ? 0 : zeros + 1;
+        out[n++] = data[i];
+    }
+    return n;
+}
+
+// MSB first reader over an RBSP. cache holds the next 56 to 64 bits, left
+// aligned; refill loads 8 bytes at once while there are enough left. Reads
+// past the end return zeros and set overrun.
+class bit_reader_t {
+public:
+    bit_reader_t(const unsigned char *data, size_t size)
+        : p(data), end(data + size), cache(0), bits(0), consumed(0),
+          total(size * 8), overrun(false)
+    {
+        refill();
+    }
+
+    uint32_t u(int n)
+    {
+        if(!n)
+            return 0;
+        refill();
+        const uint32_t v = cache >> (64 - n);
+        skip_cached(n);
+        return v;
+    }
+
+    bool flag() { return u(1); }
+
+    // Exp-Golomb: count leading zeros with clz, then read as many bits.
+    uint32_t ue()
+    {
+        refill();
+        if(!cache) {
+            overrun = true;
+            return 0;
+        }
+        const int lz = __builtin_clzll(cache);
+        if(lz > 31) {
+            overrun = true;
+            return 0;
+        }
+        if(2 * lz + 1 <= bits) {
+            const uint32_t v = (cache >> (63 - 2 * lz)) - 1;
+            skip_cached(2 * lz + 1);
+            return v;
+        }
+        skip_cached(lz);
+        return u(lz + 1) - 1;
+    }
+
+    int32_t se()
+    {
+        const uint32_t k = ue();
+        return k & 1 ? int32_t((k + 1) / 2) : -int32_t(k / 2);
+    }
+
+    // Anything but the rbsp_stop_one_bit and alignment zeros left?
+    bool more_rbsp_data(const unsigned char *data, size_t size) const
+    {
+        size_t last = size;
+        while(last && !data[last - 1])
+            last--;
+        if(!last)
+            return false;
+        const size_t stop = (last - 1) * 8 + 7 - __builtin_ctz(data[last - 1]);
+        return consumed < stop;
+    }
+
+    bool failed() const { return overrun || consumed > total; }
+
+private:
+    void refill()
+    {
+        if(bits > 56)
+            return;
+        if(end - p >= 8) {
+            uint64_t w;
+            memcpy(&w, p, 8);
+            cache |= __builtin_bswap64(w) >> bits;
+            p += (63 - bits) >> 3;
+            bits |= 56;
+            return;
+        }
+        while(bits <= 56) {
+            if(p < end)
+                cache |= uint64_t(*p++) << (56 - bits);
+            bits += 8;
+        }
+    }
+
+    void skip_cached(int n)
+    {
+        cache = n < 64 ? cache << n : 0;
+        bits -= n;
+        consumed += n;
+    }
+
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t cache;
+    int bits;
+    size_t consumed;
+    size_t total;
+    bool overrun;
+};
+
+inline void skip_scaling_list(bit_reader_t &br, int size)
+{
+    int last = 8, next = 8;
+    for(int j = 0; j < size; j++) {
+        if(next)
+            next = (last + br.se() + 256) % 256;
+        last = next ? next : last;
+    }
+}
+
+inline void skip_hrd(bit_reader_t &br)
+{
+    const auto cpb_cnt = br.ue() + 1;
+    br.u(8);
+    for(uint32_t i = 0; i < cpb_cnt && i < 32; i++) {
+        br.ue();
+        br.ue();
+        br.flag();
+    }
+    br.u(20);
+}
+
+struct sps_t {
+    unsigned profile_idc = 0;
+    unsigned constraints = 0;
+    unsigned level_idc = 0;
+    unsigned id = 0;
+    unsigned chroma_format_idc = 1;
+    unsigned bit_depth_luma = 8;
+    unsigned bit_depth_chroma = 8;
+    unsigned log2_max_frame_num = 0;
+    unsigned poc_type = 0;
+    unsigned max_num_ref_frames = 0;
+    bool frame_mbs_only = true;
+    unsigned width_mbs = 0;
+    unsigned height_map_units = 0;
+    unsigned crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    // after cropping
+    unsigned width = 0;
+    unsigned height = 0;
+    bool vui = false;
+    unsigned sar_width = 0, sar_height = 0;
+    bool full_range = false;
+    bool timing = false;
+    uint32_t num_units_in_tick = 0;
+    uint32_t time_scale = 0;
+    bool fixed_frame_rate = false;
+    bool restriction = false;
+    unsigned max_num_reorder_frames = 0;
+    unsigned max_dec_frame_buffering = 0;
+
+    double fps() const
+    {
+        return timing && num_units_in_tick
+            ? time_scale / (2.0 * num_units_in_tick) : 0;
+    }
+};
+
+// data: SPS NAL unit including the header byte
+inline bool parse_sps(const unsigned char *data, size_t size, sps_t &sps)
+{
+    if(size < 4 || (data[0] & 0x1f) != 7)
+        return false;
+    const auto rbsp = unescape(data + 1, size - 1);
+    bit_reader_t br(rbsp.data(), rbsp.size());
+    sps.profile_idc = br.u(8);
+    sps.constraints = br.u(8);
+    sps.level_idc = br.u(8);
+    sps.id = br.ue();
+    switch(sps.profile_idc) {
+    case 100: case 110: case 122: case 244: case 44: case 83: case 86:
+    case 118: case 128: case 138: case 139: case 134: case 135:
+        sps.chroma_format_idc = br.ue();
+        if(sps.chroma_format_idc == 3)
+            br.flag();
+        sps.bit_depth_luma = br.ue() + 8;
+        sps.bit_depth_chroma = br.ue() + 8;
+        br.flag();
+        if(br.flag())
+            for(int i = 0; i < (sps.chroma_format_idc != 3 ? 8 : 12); i++)
+                if(br.flag())
+                    skip_scaling_list(br, i < 6 ? 16 : 64);
+        break;
+    }
+    sps.log2_max_frame_num = br.ue() + 4;
+    sps.poc_type = br.ue();
+    if(sps.poc_type == 0) {
+        br.ue();
+    } else if(sps.poc_type == 1) {
+        br.flag();
+        br.se();
+        br.se();
+        const auto cycle = br.ue();
+        for(uint32_t i = 0; i < cycle && i < 256; i++)
+            br.se();
+    }
+    sps.max_num_ref_frames = br.ue();
+    br.flag();
+    sps.width_mbs = br.ue() + 1;
+    sps.height_map_units = br.ue() + 1;
+    sps.frame_mbs_only = br.flag();
+    if(!sps.frame_mbs_only)
+        br.flag();
+    br.flag();
+    if(br.flag()) {
+        sps.crop_left = br.ue();
+        sps.crop_right = br.ue();
+        sps.crop_top = br.ue();
+        sps.crop_bottom = br.ue();
+    }
+    // crop units in luma samples
+    const unsigned sub_w = sps.chroma_format_idc == 1 || sps.chroma_format_idc == 2 ? 2 : 1;
+    const unsigned sub_h = sps.chroma_format_idc == 1 ? 2 : 1;
+    const unsigned crop_x = sps.chroma_format_idc ? sub_w : 1;
+    const unsigned crop_y = (sps.chroma_format_idc ? sub_h : 1) * (2 - sps.frame_mbs_only);
+    const unsigned w = sps.width_mbs * 16;
+    const unsigned h = sps.height_map_units * 16 * (2 - sps.frame_mbs_only);
+    const unsigned cw = (sps.crop_left + sps.crop_right) * crop_x;
+    const unsigned ch = (sps.crop_top + sps.crop_bottom) * crop_y;
+    sps.width = cw < w ? w - cw : 0;
+    sps.height = ch < h ? h - ch : 0;
+
+    sps.vui = br.flag();
+    if(sps.vui) {
+        if(br.flag()) {
+            // Table E-1
+            static const unsigned SAR[17][2] = {
+                {0, 0}, {1, 1}, {12, 11}, {10, 11}, {16, 11}, {40, 33},
+                {24, 11}, {20, 11}, {32, 11}, {80, 33}, {18, 11}, {15, 11},
+                {64, 33}, {160, 99}, {4, 3}, {3, 2}, {2, 1}};
+            const auto idc = br.u(8);
+            if(idc == 255) {
+                sps.sar_width = br.u(16);
+                sps.sar_height = br.u(16);
+            } else if(idc < 17) {
+                sps.sar_width = SAR[idc][0];
+                sps.sar_height = SAR[idc][1];
+            }
+        }
+        if(br.flag())
+            br.flag();
+        if(br.flag()) {
+            br.u(3);
+            sps.full_range = br.flag();
+            if(br.flag())
+                br.u(24);
+        }
+        if(br.flag()) {
+            br.ue();
+            br.ue();
+        }
+        sps.timing = br.flag();
+        if(sps.timing) {
+            sps.num_units_in_tick = br.u(32);
+            sps.time_scale = br.u(32);
+            sps.fixed_frame_rate = br.flag();
+        }
+        const bool nal_hrd = br.flag();
+        if(nal_hrd)
+            skip_hrd(br);
+        const bool vcl_hrd = br.flag();
+        if(vcl_hrd)
+            skip_hrd(br);
+        if(nal_hrd || vcl_hrd)
+            br.flag();
+        br.flag();
+        sps.restriction = br.flag();
+        if(sps.restriction) {
+            br.flag();
+            br.ue();
+            br.ue();
+            br.ue();
+            br.ue();
+            sps.max_num_reorder_frames = br.ue();
+            sps.max_dec_frame_buffering = br.ue();
+        }
+    }
+    return !br.failed();
+}
+
+struct pps_t {
+    unsigned id = 0;
+    unsigned sps_id = 0;
+    bool cabac = false;
+    bool bottom_field_pic_order = false;
+    unsigned num_slice_groups = 1;
+    unsigned num_ref_idx_l0 = 0;
+    unsigned num_ref_idx_l1 = 0;
+    bool weighted_pred = false;
+    unsigned weighted_bipred_idc = 0;
+    int pic_init_qp = 26;
+    int chroma_qp_index_offset = 0;
+    bool deblocking_filter_control = false;
+    bool constrained_intra_pred = false;
+    bool transform_8x8_mode = false;
+};
+
+// data: PPS NAL unit including the header byte
+inline bool parse_pps(const unsigned char *data, size_t size, pps_t &pps)
+{
+    if(size < 2 || (data[0] & 0x1f) != 8)
+        return false;
+    const auto rbsp = unescape(data + 1, size - 1);
+    bit_reader_t br(rbsp.data(), rbsp.size());
+    pps.id = br.ue();
+    pps.sps_id = br.ue();
+    pps.cabac = br.flag();
+    pps.bottom_field_pic_order = br.flag();
+    pps.num_slice_groups = br.ue() + 1;
+    if(pps.num_slice_groups > 1)
+        // slice group maps need the SPS, stop here
+        return !br.failed();
+    pps.num_ref_idx_l0 = br.ue() + 1;
+    pps.num_ref_idx_l1 = br.ue() + 1;
+    pps.weighted_pred = br.flag();
+    pps.weighted_bipred_idc = br.u(2);
+    pps.pic_init_qp = 26 + br.se();
+    br.se();
+    pps.chroma_qp_index_offset = br.se();
+    pps.deblocking_filter_control = br.flag();
+    pps.constrained_intra_pred = br.flag();
+    br.flag();
+    if(br.more_rbsp_data(rbsp.data(), rbsp.size()))
+        pps.transform_8x8_mode = br.flag();
+    return !br.failed();
+}
+
+// Start of a slice header: first_mb_in_slice and slice_type % 5 (P, B,
+// I, SP, SI). Only the first bytes are unescaped, on the stack.
+inline bool parse_slice_start(const unsigned char *data, size_t size,
+                              unsigned &first_mb, unsigned &slice_type)
+{
+    if(size < 2)
+        return false;
+    unsigned char rbsp[16];
+    const auto n = unescape(data + 1, size - 1, rbsp, sizeof rbsp);
+    bit_reader_t br(rbsp, n);
+    first_mb = br.ue();
+    slice_type = br.ue() % 5;
+    return !br.failed();
+}
+
+inline bool is_intra(unsigned nal_type, unsigned slice_type)
+{
+    return nal_type == 5 || slice_type == 2 || slice_type == 4;
+}
+
+inline const char *profile_name(unsigned profile_idc, unsigned constraints)
+{
+    switch(profile_idc) {
+    case 66: return constraints & 0x40 ? "Constrained Baseline" : "Baseline";
+    case 77: return "Main";
+    case 88: return "Extended";
+    case 100: return "High";
+    case 110: return "High 10";
+    case 122: return "High 4:2:2";
+    case 244: return "High 4:4:4 Predictive";
+    case 44: return "CAVLC 4:4:4 Intra";
+    case 118: return "Multiview High";
+    case 128: return "Stereo High";
+    default: return "unknown";
+    }
+}
+
+inline void print(const sps_t &sps)
+{
+    static const char *CHROMA[] = {"4:0:0", "4:2:0", "4:2:2", "4:4:4"};
+    printf("sps %u: %s profile (%u), constraints 0x%02x, level %u.%u\n",
+           sps.id, profile_name(sps.profile_idc, sps.constraints),
+           sps.profile_idc, sps.constraints, sps.level_idc / 10,
+           sps.level_idc % 10);
+    printf("  %ux%u%s, %ux%u macroblocks", sps.width, sps.height,
+           sps.frame_mbs_only ? "p" : "i", sps.width_mbs,
+           sps.height_map_units * (2 - sps.frame_mbs_only));
+    if(sps.crop_left || sps.crop_right || sps.crop_top || sps.crop_bottom)
+        printf(", crop left %u right %u top %u bottom %u", sps.crop_left,
+               sps.crop_right, sps.crop_top, sps.crop_bottom);
+    printf("\n  %s %u bit, poc type %u, max ref frames %u\n",
+           CHROMA[sps.chroma_format_idc & 3], sps.bit_depth_luma,
+           sps.poc_type, sps.max_num_ref_frames);
+    if(!sps.vui)
+        return;
+    if(sps.sar_width)
+        printf("  sar %u:%u%s\n", sps.sar_width, sps.sar_height,
+               sps.full_range ? ", full range" : "");
+    if(sps.timing)
+        printf("  timing %u/%u: %.3f fps%s\n", sps.num_units_in_tick,
+               sps.time_scale, sps.fps(),
+               sps.fixed_frame_rate ? " fixed" : "");
+    if(sps.restriction)
+        printf("  reorder depth %u, dpb %u frames\n",
+               sps.max_num_reorder_frames, sps.max_dec_frame_buffering);
+}
+
+inline void print(const pps_t &pps)
+{
+    printf("pps %u: sps %u, %s, ref idx %u/%u, init qp %d%s%s\n",
+           pps.id, pps.sps_id, pps.cabac ? "CABAC" : "CAVLC",
+           pps.num_ref_idx_l0, pps.num_ref_idx_l1, pps.pic_init_qp,
+           pps.num_slice_groups > 1 ? ", slice groups" : "",
+           pps.transform_8x8_mode ? ", 8x8 transform" : "");
+}
+
+// Decodes and prints a SPS or PPS NAL unit.
+inline bool print_parameter_set(const unsigned char *data, size_t size)
+{
+    if(!size)
+        return false;
+    switch(data[0] & 0x1f) {
+    case 7: {
+        sps_t sps;
+        if(!parse_sps(data, size, sps))
+            return false;
+        print(sps);
+        return true;
+    }
+    case 8: {
+        pps_t pps;
+        if(!parse_pps(data, size, pps))
+            return false;
+        print(pps);
+        return true;
+    }
+    }
+    return false;
+}
 
-    BUF_MEM *buf;
-    BIO_get_mem_ptr(mem, &buf);
-    const auto r = std::min(buf->length, out_len);
-    memcpy(out, buf->data, r);
-    BIO_free_all(mem);
-    return r > 0 ? r : 0;
 }
 
 bool decode_sprops(const std::string &sprops)
 {
-    const char *in = sprops.c_str();
-    size_t len = sprops.length();
     size_t start = 0;
     const auto SPROP = std::string("sprop-parameter-sets=");
     if(libaan::startswith(sprops, SPROP)) {
-        in += SPROP.length();
-        if(len <= SPROP.length())
+        if(sprops.length() <= SPROP.length())
             return false;
-        len -= SPROP.length();
         start += SPROP.length();
     }
-
-    auto off = sprops.find(',', start);
-    if(off == std::string::npos)
+    if(sprops.find(',', start) == std::string::npos)
         return false;
-    assert(off >= start);
-    off -= start;
-    off++; // skip ,
-
-    std::string sps(1024, '\0');
-    sps.resize(base64decode(in, off, &sps[0], sps.length()));
-    std::string pps(1024, '\0');
-    pps.resize(base64decode(in + off, len - off, &pps[0], pps.length()));
-
-    std::cout << "sps \"";
-    for(unsigned char c: sps)
-        std::cout << std::hex << +c << " ";
-    std::cout << "\"\n";
-    std::cout << "pps \"";
-    for(unsigned char c: pps)
-        std::cout << std::hex << +c << " ";
-    std::cout << "\"\n";
-
-//    decode_sps(sps.c_str(), sps.length());
-//    decode_sps_ffmpeg(sps.c_str(), sps.length());
+
+    // sps,pps[,pps...]
+    std::vector<std::string> sets;
+    while(start < sprops.length()) {
+        auto end = sprops.find(',', start);
+        if(end == std::string::npos)
+            end = sprops.length();
+        std::string set(end - start, '\0');
+        set.resize(base64decode(sprops.c_str() + start, end - start, &set[0],
+                                set.length()));
+        sets.push_back(set);
+        start = end + 1;
+    }
+
+    for(const auto &set: sets) {
+        const unsigned type = set.empty() ? 0 : set[0] & 0x1f;
+        printf("%s \"", type == 7 ? "sps" : type == 8 ? "pps" : "nal");
+        for(unsigned char c: set)
+            printf("%x ", c);
+        puts("\"");
+    }
+    for(const auto &set: sets)
+        if(!h264::print_parameter_set(
+               reinterpret_cast<const unsigned char *>(set.data()), set.size()))
+            puts("can not decode parameter set");
     return true;
 }
 
@@ -138,21 +683,597 @@ void dumpv(const std::vector<unsigned char> &vec, size_t max = 0)
     return dumpv(vec.data(), vec.size(), max);
 }
 
+std::string base64encode(const std::vector<unsigned char> &vec)
+{
+    std::string ret((vec.size() + 2) / 3 * 4, '\0');
+    ret.resize(base64encode(vec.data(), vec.size(), &ret[0], ret.size()));
+    return ret;
+}
+
 bool encode_sprops(const std::vector<unsigned char> &sps,
                    const std::vector<unsigned char> &pps)
 {
-    std::string sps64(124, '\0');
-    sps64.resize(base64encode(reinterpret_cast<const char *>(&sps[0]), sps.size(),
-                              &sps64[0], sps64.size()));
-    std::string pps64(1024, '\0');
-    pps64.resize(base64encode(reinterpret_cast<const char *>(&pps[0]), pps.size(),
-                              &pps64[0], pps64.size()));
-                              
-    printf("sprop-parameter-sets=%s,%s\n", sps64.c_str(), pps64.c_str());
+    printf("sprop-parameter-sets=%s,%s\n", base64encode(sps).c_str(),
+           base64encode(pps).c_str());
 
     return true;
 }
 
+// Annex B byte stream scanning without the GStreamer parser, which looks at
+// every byte on its own. Start codes are searched 64 bytes at a time: one
+// bitmask of 0x00 bytes and one of 0x01 bytes, a candidate is a 0x01 with
+// two zeros in front. Outside start codes the emulation prevention byte
+// keeps 00 00 01 out of the stream, so candidates are rare.
+namespace annexb {
+
+// Index of the 0x01 byte of the first 00 00 01 in data[pos, len), or len.
+inline size_t find_start_code(const unsigned char *data, size_t pos, size_t len)
+{
+    // zeros of the two bytes before pos
+    uint64_t prev = (pos >= 1 && !data[pos - 1] ? 1ull << 63 : 0)
+        | (pos >= 2 && !data[pos - 2] ? 1ull << 62 : 0);
+#ifdef __SSE2__
+    const auto zero = _mm_setzero_si128();
+    const auto one = _mm_set1_epi8(1);
+    for(; pos + 64 <= len; pos += 64) {
+        uint64_t z = 0, o = 0;
+        for(int i = 0; i < 4; i++) {
+            const auto v = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data + pos + i * 16));
+            z |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)))) << (i * 16);
+            o |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, one)))) << (i * 16);
+        }
+        // bit i: byte i is 01, bytes i - 1 and i - 2 are 00
+        const uint64_t sc = o & (z << 1 | prev >> 63) & (z << 2 | prev >> 62);
+        if(sc)
+            return pos + __builtin_ctzll(sc);
+        prev = z;
+    }
+#endif
+    for(; pos < len; pos++) {
+        if(data[pos] == 1 && (prev >> 62) == 3)
+            return pos;
+        prev = (prev >> 1 | uint64_t(!data[pos]) << 63) & (3ull << 62);
+    }
+    return len;
+}
+
+struct nal_t {
+    // first byte of the start code, including a leading zero
+    size_t sc_offset;
+    // NAL header byte
+    size_t offset;
+    // without trailing zero bytes
+    size_t size;
+    unsigned type;
+};
+
+// Calls cb(const nal_t &) for each NAL unit in data. Unless last, the unit
+// after the final start code is left alone, it may continue in the next
+// block. Returns how much of data was consumed.
+template<typename lambda_t>
+size_t foreach_nal(const unsigned char *data, size_t len, bool last, lambda_t cb)
+{
+    size_t sc = find_start_code(data, 0, len);
+    while(sc < len) {
+        nal_t nal;
+        nal.offset = sc + 1;
+        nal.sc_offset = sc > 2 && !data[sc - 3] ? sc - 3 : sc - 2;
+        const auto next = nal.offset < len ? find_start_code(data, nal.offset, len)
+                                           : len;
+        if(next == len && !last)
+            return nal.sc_offset;
+        // the next start code begins two bytes before its 01
+        size_t end = next == len ? len : next - 2;
+        while(end > nal.offset && !data[end - 1])
+            end--;
+        nal.size = end - nal.offset;
+        if(nal.size) {
+            nal.type = data[nal.offset] & 0x1f;
+            cb(nal);
+        }
+        sc = next;
+    }
+    return len;
+}
+
+}
+
+inline uint32_t be16(const unsigned char *p) { return p[0] << 8 | p[1]; }
+
+inline uint32_t be32(const unsigned char *p)
+{
+    return uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+inline uint64_t be64(const unsigned char *p)
+{
+    return uint64_t(be32(p)) << 32 | be32(p + 4);
+}
+
+// ISO BMFF (MP4/MOV): the parameter sets are in the avcC box of the
+// sample description, no need to look at the samples. Only box headers
+// on the way there are read, mdat is skipped by its size.
+namespace mp4 {
+
+constexpr uint32_t fourcc(const char (&s)[5])
+{
+    return uint32_t(uint8_t(s[0])) << 24 | uint8_t(s[1]) << 16
+        | uint8_t(s[2]) << 8 | uint8_t(s[3]);
+}
+
+// Calls cb(type, payload, payload_size) for each box in data until cb
+// returns false. Returns false on a truncated box.
+template<typename lambda_t>
+bool foreach_box(const unsigned char *data, size_t len, lambda_t cb)
+{
+    size_t pos = 0;
+    while(len - pos >= 8) {
+        uint64_t size = be32(data + pos);
+        const uint32_t type = be32(data + pos + 4);
+        size_t header = 8;
+        if(size == 1) {
+            if(len - pos < 16)
+                return false;
+            size = be64(data + pos + 8);
+            header = 16;
+        } else if(size == 0) {
+            // up to the end of the file
+            size = len - pos;
+        }
+        if(size < header || size > len - pos)
+            return false;
+        if(!cb(type, data + pos + header, size_t(size - header)))
+            return true;
+        pos += size;
+    }
+    return pos == len;
+}
+
+// ftyp first, or a QuickTime file starting with one of the top level
+// boxes.
+inline bool is_mp4(const unsigned char *data, size_t len)
+{
+    if(len < 8)
+        return false;
+    switch(be32(data + 4)) {
+    case fourcc("ftyp"):
+    case fourcc("moov"):
+    case fourcc("mdat"):
+    case fourcc("wide"):
+    case fourcc("free"):
+    case fourcc("skip"):
+        return be32(data) == 1 || be32(data) >= 8;
+    }
+    return false;
+}
+
+// AVCDecoderConfigurationRecord, ISO/IEC 14496-15 5.3.3.1
+struct avcc_t {
+    unsigned profile_idc;
+    unsigned level_idc;
+    unsigned length_size;
+    std::vector<std::vector<unsigned char>> sps;
+    std::vector<std::vector<unsigned char>> pps;
+};
+
+inline bool parse_avcc(const unsigned char *data, size_t len, avcc_t &avcc)
+{
+    if(len < 7 || data[0] != 1)
+        return false;
+    avcc.profile_idc = data[1];
+    avcc.level_idc = data[3];
+    avcc.length_size = (data[4] & 3) + 1;
+    size_t pos = 5;
+    for(auto *sets: { &avcc.sps, &avcc.pps }) {
+        if(pos >= len)
+            return false;
+        unsigned n = data[pos++];
+        if(sets == &avcc.sps)
+            n &= 0x1f;
+        for(unsigned i = 0; i < n; i++) {
+            if(len - pos < 2 || len - pos - 2 < be16(data + pos))
+                return false;
+            const size_t size = be16(data + pos);
+            sets->emplace_back(data + pos + 2, data + pos + 2 + size);
+            pos += 2 + size;
+        }
+    }
+    return true;
+}
+
+// stsd: full box header and entry_count, then the sample entries. An
+// avc1/avc3 entry has 8 bytes of SampleEntry and 70 bytes of
+// VisualSampleEntry fields before its child boxes.
+template<typename lambda_t>
+void foreach_avcc_in_stsd(const unsigned char *data, size_t len,
+                          unsigned track, lambda_t &cb)
+{
+    if(len < 8)
+        return;
+    foreach_box(data + 8, len - 8, [track, &cb](uint32_t type,
+                                                const unsigned char *p,
+                                                size_t n) {
+        if((type != fourcc("avc1") && type != fourcc("avc3")) || n < 78)
+            return true;
+        foreach_box(p + 78, n - 78, [track, &cb](uint32_t child,
+                                                 const unsigned char *c,
+                                                 size_t m) {
+            avcc_t avcc;
+            if(child == fourcc("avcC") && parse_avcc(c, m, avcc))
+                cb(track, avcc);
+            return true;
+        });
+        return true;
+    });
+}
+
+// Descends moov/trak/mdia/minf/stbl, all plain containers, to stsd.
+template<typename lambda_t>
+void walk(const unsigned char *data, size_t len, size_t depth,
+          unsigned &track, lambda_t &cb)
+{
+    static const uint32_t PATH[] = { fourcc("moov"), fourcc("trak"),
+                                     fourcc("mdia"), fourcc("minf"),
+                                     fourcc("stbl"), fourcc("stsd") };
+    foreach_box(data, len, [depth, &track, &cb](uint32_t type,
+                                                const unsigned char *p,
+                                                size_t n) {
+        if(type != PATH[depth])
+            return true;
+        if(type == fourcc("trak"))
+            ++track;
+        if(type == fourcc("stsd"))
+            foreach_avcc_in_stsd(p, n, track, cb);
+        else
+            walk(p, n, depth + 1, track, cb);
+        return true;
+    });
+}
+
+// Calls cb(track, avcc_t) for each avc1/avc3 sample description.
+// track counts the trak boxes from 1.
+template<typename lambda_t>
+void foreach_avcc(const unsigned char *data, size_t len, lambda_t cb)
+{
+    unsigned track = 0;
+    walk(data, len, 0, track, cb);
+}
+
+}
+
+// pcap and pcapng captures of H.264 over RTP, RFC 6184. Packets are
+// parsed in place in the mapping.
+namespace pcap {
+
+enum : uint32_t {
+    PCAP_MAGIC = 0xa1b2c3d4,
+    // nanosecond timestamps
+    PCAP_MAGIC_NS = 0xa1b23c4d,
+    PCAPNG_SHB = 0x0a0d0d0a,
+    PCAPNG_BYTE_ORDER = 0x1a2b3c4d,
+    PCAPNG_IDB = 1,
+    PCAPNG_SPB = 3,
+    PCAPNG_EPB = 6,
+};
+
+// Fields in the byte order of the machine that wrote the file.
+struct reader_t {
+    uint16_t u16(const unsigned char *p) const
+    {
+        uint16_t v;
+        memcpy(&v, p, sizeof v);
+        return swap ? __builtin_bswap16(v) : v;
+    }
+
+    uint32_t u32(const unsigned char *p) const
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        return swap ? __builtin_bswap32(v) : v;
+    }
+
+    bool swap = false;
+};
+
+inline bool is_pcap(const unsigned char *data, size_t len)
+{
+    if(len < 24)
+        return false;
+    const reader_t native;
+    const auto magic = native.u32(data);
+    return magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS
+        || __builtin_bswap32(magic) == PCAP_MAGIC
+        || __builtin_bswap32(magic) == PCAP_MAGIC_NS || magic == PCAPNG_SHB;
+}
+
+// Calls cb(linktype, packet, captured_length) for each packet. A packet
+// cut off by the end of the file ends the loop.
+template<typename lambda_t>
+void foreach_packet(const unsigned char *data, size_t len, lambda_t cb)
+{
+    reader_t rd;
+    if(rd.u32(data) != PCAPNG_SHB) {
+        const auto magic = rd.u32(data);
+        rd.swap = magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS;
+        const auto linktype = rd.u32(data + 20);
+        for(size_t pos = 24; len - pos >= 16;) {
+            const size_t caplen = rd.u32(data + pos + 8);
+            if(caplen > len - pos - 16)
+                return;
+            cb(linktype, data + pos + 16, caplen);
+            pos += 16 + caplen;
+        }
+        return;
+    }
+
+    // blocks of type, total length, body, total length
+    std::vector<unsigned> linktypes;
+    for(size_t pos = 0; len - pos >= 12;) {
+        const unsigned char *b = data + pos;
+        if(rd.u32(b) == PCAPNG_SHB) {
+            // new section, its byte order
+            rd.swap = false;
+            rd.swap = rd.u32(b + 8) != PCAPNG_BYTE_ORDER;
+            linktypes.clear();
+        }
+        const size_t block = rd.u32(b + 4);
+        if(block < 12 || block % 4 || block > len - pos)
+            return;
+        const unsigned char *body = b + 8;
+        const size_t body_len = block - 12;
+        switch(rd.u32(b)) {
+        case PCAPNG_IDB:
+            if(body_len >= 8)
+                linktypes.push_back(rd.u16(body));
+            break;
+        case PCAPNG_EPB:
+            if(body_len >= 20) {
+                const auto iface = rd.u32(body);
+                const size_t caplen = rd.u32(body + 12);
+                if(iface < linktypes.size() && caplen <= body_len - 20)
+                    cb(linktypes[iface], body + 20, caplen);
+            }
+            break;
+        case PCAPNG_SPB:
+            if(body_len >= 4 && !linktypes.empty())
+                cb(linktypes[0], body + 4,
+                   std::min<size_t>(rd.u32(body), body_len - 4));
+            break;
+        }
+        pos += block;
+    }
+}
+
+struct udp_t {
+    unsigned src_port;
+    unsigned dst_port;
+    const unsigned char *payload;
+    size_t size;
+};
+
+// Walks the link and IP headers. False unless the packet is a whole UDP
+// datagram over IPv4 or IPv6.
+inline bool parse_udp(unsigned linktype, const unsigned char *p, size_t len,
+                      udp_t &udp)
+{
+    unsigned ethertype = 0;
+    switch(linktype) {
+    case 0:
+        // BSD loopback, address family in host order: look at the IP
+        // version instead
+        if(len < 4)
+            return false;
+        p += 4;
+        len -= 4;
+        break;
+    case 1:
+        // Ethernet, VLAN tags
+        if(len < 14)
+            return false;
+        ethertype = be16(p + 12);
+        p += 14;
+        len -= 14;
+        while((ethertype == 0x8100 || ethertype == 0x88a8) && len >= 4) {
+            ethertype = be16(p + 2);
+            p += 4;
+            len -= 4;
+        }
+        break;
+    case 113:
+        // Linux cooked capture
+        if(len < 16)
+            return false;
+        ethertype = be16(p + 14);
+        p += 16;
+        len -= 16;
+        break;
+    case 276:
+        // Linux cooked capture v2
+        if(len < 20)
+            return false;
+        ethertype = be16(p);
+        p += 20;
+        len -= 20;
+        break;
+    case 12:
+    case 14:
+    case 101:
+        // raw IP
+        break;
+    default:
+        return false;
+    }
+    if(!len)
+        return false;
+    if(!ethertype)
+        ethertype = p[0] >> 4 == 6 ? 0x86dd : 0x0800;
+
+    if(ethertype == 0x0800) {
+        if(len < 20 || p[0] >> 4 != 4)
+            return false;
+        const size_t ihl = (p[0] & 0xf) * 4;
+        const size_t total = be16(p + 2);
+        // fragments are not reassembled
+        if(p[9] != 17 || (be16(p + 6) & 0x3fff) || ihl < 20 || total < ihl
+           || total > len)
+            return false;
+        p += ihl;
+        len = total - ihl;
+    } else if(ethertype == 0x86dd) {
+        if(len < 40 || p[0] >> 4 != 6)
+            return false;
+        unsigned next = p[6];
+        const size_t payload = be16(p + 4);
+        if(payload > len - 40)
+            return false;
+        p += 40;
+        len = payload;
+        // hop by hop, routing and destination options headers
+        while((next == 0 || next == 43 || next == 60) && len >= 8) {
+            const size_t ext = (p[1] + 1) * 8;
+            if(ext > len)
+                return false;
+            next = p[0];
+            p += ext;
+            len -= ext;
+        }
+        if(next != 17)
+            return false;
+    } else {
+        return false;
+    }
+
+    if(len < 8 || be16(p + 4) < 8 || be16(p + 4) > len)
+        return false;
+    udp.src_port = be16(p);
+    udp.dst_port = be16(p + 2);
+    udp.payload = p + 8;
+    udp.size = be16(p + 4) - 8;
+    return true;
+}
+
+struct rtp_t {
+    uint32_t ssrc;
+    uint16_t seq;
+    unsigned payload_type;
+    const unsigned char *payload;
+    size_t size;
+};
+
+// H.264 always has a dynamic payload type, which also keeps RTCP and
+// most other UDP traffic out.
+inline bool parse_rtp(const unsigned char *p, size_t len, rtp_t &rtp)
+{
+    if(len < 12 || p[0] >> 6 != 2 || (p[1] & 0x7f) < 96)
+        return false;
+    size_t header = 12 + (p[0] & 0xf) * 4;
+    if(p[0] & 0x10) {
+        if(len < header + 4)
+            return false;
+        header += 4 + be16(p + header + 2) * 4;
+    }
+    size_t end = len;
+    if(p[0] & 0x20) {
+        if(!p[len - 1] || p[len - 1] > len)
+            return false;
+        end -= p[len - 1];
+    }
+    if(header >= end)
+        return false;
+    rtp.ssrc = be32(p + 8);
+    rtp.seq = be16(p + 2);
+    rtp.payload_type = p[1] & 0x7f;
+    rtp.payload = p + header;
+    rtp.size = end - header;
+    return true;
+}
+
+enum : unsigned { STAP_A = 24, FU_A = 28 };
+
+// Does the payload carry a SPS? It has to decode, other RTP streams with
+// a dynamic payload type look like H.264 now and then.
+inline bool has_sps(const rtp_t &rtp)
+{
+    h264::sps_t sps;
+    const auto p = rtp.payload;
+    switch(p[0] & 0x1f) {
+    case STAP_A:
+        for(size_t pos = 1; pos + 2 < rtp.size; pos += 2 + be16(p + pos)) {
+            const size_t size = std::min<size_t>(be16(p + pos),
+                                                 rtp.size - pos - 2);
+            if(h264::parse_sps(p + pos + 2, size, sps))
+                return true;
+        }
+        return false;
+    case FU_A:
+        return rtp.size > 1 && (p[1] & 0x80)
+            && (p[1] & 0x1f) == h264::NAL_SPS;
+    }
+    return h264::parse_sps(p, rtp.size, sps);
+}
+
+// Single NAL unit packets, STAP-A and FU-A (packetization modes 0 and
+// 1) to finder. Units in a packet are passed where they are in the
+// mapping, only fragmented ones are put together in a buffer. A
+// sequence number gap drops the fragmented unit in progress.
+template<typename finder_t>
+struct depacketizer_t {
+    explicit depacketizer_t(finder_t &finder) : finder(finder) {}
+
+    // offset: of rtp.payload in the file
+    void operator()(const rtp_t &rtp, size_t offset)
+    {
+        if(packets && rtp.seq != uint16_t(seq + 1)) {
+            const uint16_t gap = rtp.seq - seq - 1;
+            if(gap < 0x8000)
+                lost += gap;
+            fu.clear();
+        }
+        ++packets;
+        seq = rtp.seq;
+
+        const auto p = rtp.payload;
+        const unsigned type = p[0] & 0x1f;
+        if(type >= 1 && type <= 23) {
+            finder(type, p, rtp.size, offset);
+        } else if(type == STAP_A) {
+            for(size_t pos = 1; rtp.size - pos > 2;) {
+                const size_t size = be16(p + pos);
+                pos += 2;
+                if(!size || size > rtp.size - pos)
+                    break;
+                finder(p[pos] & 0x1f, p + pos, size, offset + pos);
+                pos += size;
+            }
+        } else if(type == FU_A && rtp.size > 2) {
+            if(p[1] & 0x80) {
+                fu.assign(1, (p[0] & 0xe0) | (p[1] & 0x1f));
+                fu_offset = offset;
+            }
+            if(!fu.empty())
+                fu.insert(fu.end(), p + 2, p + rtp.size);
+            if((p[1] & 0x40) && !fu.empty()) {
+                finder(fu[0] & 0x1f, fu.data(), fu.size(), fu_offset);
+                fu.clear();
+            }
+        }
+    }
+
+    finder_t &finder;
+    size_t packets = 0;
+    size_t lost = 0;
+    uint16_t seq = 0;
+    std::vector<unsigned char> fu;
+    size_t fu_offset = 0;
+};
+
+}
+
+// Reads the file in blocks, for input that can not be mapped. A block is
+// handed to lambda, which returns how much of it was consumed. The rest is
+// moved to the front; the buffer grows if not even one NALU fit into it.
+// The last block is passed with eof set.
 template<size_t blobsize, typename lambda_t>
 void foreach_blob(const char *filename, lambda_t lambda)
 {
@@ -165,95 +1286,1406 @@ void foreach_blob(const char *filename, lambda_t lambda)
         fill += fp.gcount();
         if(!fill)
             return;
-        const auto ret = lambda(buf.data(), fill, total_off);
+        const auto ret = lambda(buf.data(), fill, total_off, fp.eof());
         if(!ret.first)
             break;
 
         assert(fill >= ret.second);
-        assert(!ret.first ? ret.second != 0 : true);
-        if(ret.first && ret.second == 0)
-            printf("No NALUs found in buffer of size %zu. incresing buffer might help\n", blobsize);
+        if(ret.second == 0 && fill == buf.size())
+            buf.resize(buf.size() * 2);
 
         fill -= ret.second;
         if(fill)
-            std::rotate(std::begin(buf), std::begin(buf) + ret.second, std::end(buf));
+            memmove(buf.data(), buf.data() + ret.second, fill);
         total_off += ret.second;
     } while(!fp.eof());
 }
 
-bool do_blockwise(const char *file)
-{
-    auto parser = gst_h264_nal_parser_new();
+// Read only mapping of a regular file, with read ahead for one pass.
+struct mapped_file_t {
+    explicit mapped_file_t(const char *filename)
+        : fd(open(filename, O_RDONLY | O_CLOEXEC)), data(nullptr), size(0)
+    {
+        struct stat s;
+        if(fd == -1 || fstat(fd, &s) == -1 || !S_ISREG(s.st_mode)
+           || s.st_size == 0)
+            return;
+        void *p = mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED) {
+            perror("mmap");
+            return;
+        }
+        if(madvise(p, s.st_size, MADV_SEQUENTIAL) == -1)
+            perror("madvise");
+        data = static_cast<const unsigned char *>(p);
+        size = s.st_size;
+    }
+
+    ~mapped_file_t()
+    {
+        if(data)
+            munmap(const_cast<unsigned char *>(data), size);
+        if(fd != -1)
+            close(fd);
+    }
+
+    mapped_file_t(const mapped_file_t &) = delete;
+    mapped_file_t &operator=(const mapped_file_t &) = delete;
+
+    bool is_ok() const { return data != nullptr; }
+
+    int fd;
+    const unsigned char *data;
+    size_t size;
+};
+
+// Collects SPS/PPS pairs from a sequence of NALUs and prints a
+// sprop-parameter-sets line for each.
+struct sprop_finder_t {
+    // data points to the NAL header byte, at offset in the input
+    void operator()(unsigned type, const unsigned char *data, size_t size,
+                    size_t)
+    {
+        ++count;
+        switch(type) {
+        case h264::NAL_SPS:
+            if(!sps.empty()) {
+                puts("no pps between sps. ignoring last sps");
+                sps.clear();
+            }
+
+            printf("have sps: size=%zu\n", size);
+            dumpv(data, size, size);
+            sps.insert(std::begin(sps), data, data + size);
+            last_sps = count;
+            break;
+        case h264::NAL_PPS:
+            assert(pps.empty());
+            assert(count > last_sps);
+            if(count - last_sps > 1)
+                printf("distance: pps - sps > 1: %zu\n", count - last_sps);
+            printf("have pps: size=%zu\n", size);
+            dumpv(data, size, size);
+            if(sps.empty()) {
+                puts("no sps before pps. ignoring pps");
+                break;
+            }
+            pps.insert(std::begin(pps), data, data + size);
+            assert(!sps.empty() && !pps.empty());
+            encode_sprops(sps, pps);
+            have = true;
+            puts("");
+            sps.clear();
+            pps.clear();
+
+            break;
+        }
+    }
+
+    // n NALUs not passed in
+    void skip(size_t n) { count += n; }
+
     size_t count = 0;
     size_t last_sps = 0;
     bool have = false;
     std::vector<unsigned char> sps;
     std::vector<unsigned char> pps;
-    // buffer size must be larger than largest NALU
-    foreach_blob<32768 * 6>
-        (file, [&parser, &count, &sps, &pps, &last_sps, &have]
-         (const unsigned char *data, size_t len, size_t total_off) {
-            size_t off = 0;
-            do {
-                GstH264NalUnit nalu;
-                const auto result = gst_h264_parser_identify_nalu(parser, data, off, len, &nalu);
-                if(result == GST_H264_PARSER_NO_NAL_END)
-                    break;
-                if(result != GST_H264_PARSER_OK)
-                    return std::make_pair(false, 0lu);
-
-                ++count;
-                assert(nalu.offset >= nalu.sc_offset);
-                assert(len > (nalu.offset + nalu.size));
-                //const auto sc_size = nalu.offset - nalu.sc_offset;
-                switch(nalu.type) {
-                case GST_H264_NAL_SPS:
-                    if(!sps.empty()) {
-                        puts("no pps between sps. ignoring last sps");
-                        sps.clear();
-                    }
-
-                    printf("have sps: size=%u\n", nalu.size);
-                    dumpv(data + nalu.offset, nalu.size, nalu.size);
-                    sps.insert(std::begin(sps), data + nalu.offset,
-                               data + nalu.offset + nalu.size);
-                    last_sps = count;
-                    break;
-                case GST_H264_NAL_PPS:
-                    assert(pps.empty());
-                    assert(count > last_sps);
-                    if(count - last_sps > 1)
-                        printf("distance: pps - sps > 1: %zu\n", count - last_sps);
-                    printf("have pps: size=%u\n", nalu.size);
-                    dumpv(data + nalu.offset, nalu.size, nalu.size);
-                    if(sps.empty()) {
-                        puts("no sps before pps. ignoring pps");
-                        break;
-                    }
-                    pps.insert(std::begin(pps), data + nalu.offset,
-                               data + nalu.offset + nalu.size);
-                    assert(!sps.empty() && !pps.empty());
-                    encode_sprops(sps, pps);
-                    have = true;
-                    puts("");
-                    sps.clear();
-                    pps.clear();
+};
 
-                    break;
-                }
+// Keeps each distinct SPS/PPS pair once, hashed with FNV-1a. A pair is
+// printed when it is first seen and whenever the stream switches to
+// another one, so mid-stream changes show up right away. summary() lists
+// all of them with first and last offset and how often they occurred.
+struct config_table_t {
+    struct config_t {
+        std::vector<unsigned char> sps;
+        std::vector<unsigned char> pps;
+        // of the SPS
+        size_t first;
+        size_t last;
+        size_t count;
+    };
+
+    void operator()(unsigned type, const unsigned char *data, size_t size,
+                    size_t offset)
+    {
+        switch(type) {
+        case h264::NAL_SPS:
+            sps.assign(data, data + size);
+            sps_offset = offset;
+            have_sps = true;
+            break;
+        case h264::NAL_PPS:
+            // paired like sprop_finder_t: first PPS after a SPS
+            if(!have_sps)
+                break;
+            have_sps = false;
+            add(data, size);
+            break;
+        }
+    }
+
+    void skip(size_t) {}
+
+    void summary() const
+    {
+        printf("%6s %14s %14s %10s  %s\n", "config", "first", "last",
+               "count", "sprop-parameter-sets");
+        for(size_t i = 0; i < configs.size(); i++) {
+            const auto &c = configs[i];
+            printf("%6zu %14zu %14zu %10zu  %s,%s\n", i, c.first, c.last,
+                   c.count, base64encode(c.sps).c_str(),
+                   base64encode(c.pps).c_str());
+        }
+    }
+
+    bool have = false;
+    std::vector<config_t> configs;
+
+private:
+    static uint64_t fnv1a(uint64_t h, const unsigned char *data, size_t len)
+    {
+        for(size_t i = 0; i < len; i++)
+            h = (h ^ data[i]) * 1099511628211ull;
+        return h;
+    }
+
+    void add(const unsigned char *pps, size_t pps_size)
+    {
+        // the SPS size is hashed too, the boundary is part of the key
+        const uint64_t n = sps.size();
+        auto h = fnv1a(14695981039346656037ull,
+                       reinterpret_cast<const unsigned char *>(&n), sizeof n);
+        h = fnv1a(fnv1a(h, sps.data(), sps.size()), pps, pps_size);
+
+        size_t idx = configs.size();
+        const auto range = index.equal_range(h);
+        for(auto it = range.first; it != range.second; ++it) {
+            const auto &c = configs[it->second];
+            if(c.sps == sps && c.pps.size() == pps_size
+               && std::equal(pps, pps + pps_size, c.pps.begin())) {
+                idx = it->second;
+                break;
+            }
+        }
+
+        if(idx == configs.size()) {
+            index.emplace(h, idx);
+            configs.push_back(config_t { sps, std::vector<unsigned char>(
+                        pps, pps + pps_size), sps_offset, sps_offset, 0 });
+            printf("config %zu at offset %zu:\n", idx, sps_offset);
+            encode_sprops(configs[idx].sps, configs[idx].pps);
+            h264::print_parameter_set(sps.data(), sps.size());
+            puts("");
+            fflush(stdout);
+        } else if(idx != current) {
+            printf("config %zu at offset %zu\n\n", idx, sps_offset);
+            fflush(stdout);
+        }
+        auto &c = configs[idx];
+        c.last = sps_offset;
+        ++c.count;
+        current = idx;
+        have = true;
+    }
+
+    std::unordered_multimap<uint64_t, size_t> index;
+    std::vector<unsigned char> sps;
+    size_t sps_offset = 0;
+    bool have_sps = false;
+    size_t current = SIZE_MAX;
+};
 
-                off = nalu.offset + nalu.size;
-            } while(true);
+template<typename finder_t>
+bool do_blockwise(const char *file, finder_t &finder)
+{
+    foreach_blob<32768 * 6>
+        (file, [&finder]
+         (const unsigned char *data, size_t len, size_t total_off, bool eof) {
+            const auto off = annexb::foreach_nal(
+                data, len, eof,
+                [&finder, data, total_off](const annexb::nal_t &nal) {
+                    finder(nal.type, data + nal.offset, nal.size,
+                           total_off + nal.offset); });
             return std::make_pair(true, off);
         });
+    return finder.have;
+}
+
+// Same on the whole mapping: no copies and no limit on the NALU size.
+template<typename finder_t>
+bool do_mmap(const mapped_file_t &file, finder_t &finder)
+{
+    annexb::foreach_nal(file.data, file.size, true,
+                        [&finder, &file](const annexb::nal_t &nal) {
+                            finder(nal.type, file.data + nal.offset, nal.size,
+                                   nal.offset); });
+    return finder.have;
+}
+
+// --stats: NAL type histogram, slice types, distances between IDR and
+// intra pictures, NALU sizes and a bitrate per second of stream time,
+// the clock being the frame rate from the SPS. Filled in one pass, only
+// a new distinct interval or another second allocates.
+struct stats_t {
+    void operator()(unsigned type, const unsigned char *data, size_t size,
+                    size_t)
+    {
+        ++nals;
+        bytes += size;
+        max_size = std::max(max_size, size);
+        ++types[type].count;
+        types[type].bytes += size;
+        second_bytes += size;
+        have = true;
+
+        if(type == h264::NAL_SPS) {
+            h264::sps_t sps;
+            if(h264::parse_sps(data, size, sps) && sps.fps() > 0)
+                fps = sps.fps();
+        } else if(type == 1 || type == 5) {
+            slice(type == 5, data, size);
+        }
+    }
+
+    void skip(size_t) {}
+
+    void summary() const
+    {
+        static const char *NAMES[] = {
+            "unspecified", "slice", "partition a", "partition b",
+            "partition c", "idr slice", "sei", "sps", "pps", "aud",
+            "end of seq", "end of stream", "filler", "sps ext",
+            "prefix", "subset sps" };
+        printf("nal units: %zu, %zu bytes, largest %zu, average %.1f\n",
+               nals, bytes, max_size, nals ? double(bytes) / nals : 0);
+        printf("%4s %-14s %10s %14s\n", "type", "", "count", "bytes");
+        for(unsigned t = 0; t < 32; t++)
+            if(types[t].count)
+                printf("%4u %-14s %10zu %14zu\n", t,
+                       t < sizeof NAMES / sizeof *NAMES ? NAMES[t] : "",
+                       types[t].count, types[t].bytes);
+        printf("slices: P %zu, B %zu, I %zu, SP %zu, SI %zu\n",
+               slice_types[0], slice_types[1], slice_types[2],
+               slice_types[3], slice_types[4]);
+        printf("pictures: %zu, idr %zu\n", pictures, idrs);
+        print_distribution("idr interval", idr_intervals);
+        print_distribution("gop length", gop_lengths);
+
+        if(!fps) {
+            puts("bitrate: no timing info in sps");
+            return;
+        }
+        // the last second is usually incomplete
+        const auto &s = seconds;
+        if(s.empty()) {
+            printf("bitrate: %.1f kbit/s over %.2f s\n",
+                   time ? second_bytes * 8 / time / 1000 : 0, time);
+            return;
+        }
+        const auto minmax = std::minmax_element(s.begin(), s.end());
+        uint64_t sum = 0;
+        for(const auto b: s)
+            sum += b;
+        printf("bitrate over %.2f s: average %.1f kbit/s, min %.1f kbit/s"
+               " in second %zu, max %.1f kbit/s in second %zu\n", time,
+               sum * 8.0 / s.size() / 1000, *minmax.first * 8.0 / 1000,
+               minmax.first - s.begin(), *minmax.second * 8.0 / 1000,
+               minmax.second - s.begin());
+    }
+
+    bool have = false;
+
+private:
+    struct count_t {
+        size_t count = 0;
+        size_t bytes = 0;
+    };
+
+    // slice_type and first_mb_in_slice from the header. A picture starts
+    // with its first macroblock.
+    void slice(bool idr, const unsigned char *data, size_t size)
+    {
+        unsigned first_mb, slice_type;
+        if(!h264::parse_slice_start(data, size, first_mb, slice_type))
+            return;
+        ++slice_types[slice_type];
+        if(first_mb)
+            return;
+
+        if(fps) {
+            // the frame rate may change with the SPS
+            if(time >= seconds.size() + 1) {
+                seconds.push_back(second_bytes);
+                second_bytes = 0;
+            }
+            time += 1 / fps;
+        }
+        const bool intra = h264::is_intra(idr ? 5 : 1, slice_type);
+        if(idr) {
+            if(idrs)
+                ++idr_intervals[pictures - last_idr];
+            ++idrs;
+            last_idr = pictures;
+        }
+        if(intra) {
+            if(intras)
+                ++gop_lengths[pictures - last_intra];
+            ++intras;
+            last_intra = pictures;
+        }
+        ++pictures;
+    }
+
+    static void print_distribution(const char *name,
+                                   const std::map<size_t, size_t> &d)
+    {
+        printf("%s (pictures):", name);
+        if(d.empty())
+            printf(" -");
+        for(const auto &e: d)
+            printf(" %zu x%zu", e.first, e.second);
+        puts("");
+    }
+
+    size_t nals = 0;
+    size_t bytes = 0;
+    size_t max_size = 0;
+    count_t types[32];
+    size_t slice_types[5] = {};
+    size_t pictures = 0;
+    size_t idrs = 0;
+    size_t last_idr = 0;
+    size_t intras = 0;
+    size_t last_intra = 0;
+    std::map<size_t, size_t> idr_intervals;
+    std::map<size_t, size_t> gop_lengths;
+    double fps = 0;
+    // stream time at the current picture
+    double time = 0;
+    // finished seconds, and the bytes since
+    std::vector<uint64_t> seconds;
+    uint64_t second_bytes = 0;
+};
+
+// SPS and PPS found by one thread of do_mmap_parallel. index counts all
+// NALUs of the range before this one.
+struct range_scan_t {
+    struct event_t {
+        unsigned type;
+        size_t offset;
+        size_t size;
+        size_t index;
+    };
+
+    void operator()(const annexb::nal_t &nal)
+    {
+        if(nal.type == h264::NAL_SPS || nal.type == h264::NAL_PPS)
+            events.push_back(event_t { nal.type, base + nal.offset, nal.size,
+                                       count });
+        ++count;
+    }
+
+    size_t base = 0;
+    size_t count = 0;
+    std::vector<event_t> events;
+};
+
+// do_mmap on threads. Range i owns the start codes whose 01 byte is in
+// [i * size / threads, (i + 1) * size / threads). Each thread scans from
+// its first start code to the first one of the next range, which gives
+// the same units as one pass. The events are then passed to finder in
+// stream order, with skip() standing in for the NALUs in between.
+template<typename finder_t>
+bool do_mmap_parallel(const mapped_file_t &file, finder_t &finder,
+                      unsigned threads)
+{
+    // not worth a thread below this
+    const size_t MIN_RANGE = 4 << 20;
+    threads = std::max<size_t>(1, std::min<size_t>(threads, file.size / MIN_RANGE));
+
+    // 01 byte of the first start code of each range, file.size if none
+    std::vector<size_t> first(threads + 1, file.size);
+    std::vector<range_scan_t> ranges(threads);
+    std::vector<std::thread> workers;
+    for(unsigned i = 0; i < threads; i++)
+        workers.emplace_back([&file, &first, i, threads] {
+                first[i] = annexb::find_start_code(
+                    file.data, file.size / threads * i, file.size); });
+    for(auto &w: workers)
+        w.join();
+    workers.clear();
+
+    for(unsigned i = 0; i < threads; i++) {
+        if(first[i] == first[i + 1])
+            continue;
+        // begin with the start code, a leading zero included; end where
+        // the next range's start code begins
+        const size_t sc = first[i];
+        const size_t begin = sc > 2 && !file.data[sc - 3] ? sc - 3 : sc - 2;
+        const size_t end = first[i + 1] == file.size ? file.size
+                                                     : first[i + 1] - 2;
+        auto &range = ranges[i];
+        range.base = begin;
+        workers.emplace_back([&file, &range, begin, end] {
+                annexb::foreach_nal(file.data + begin, end - begin, true,
+                                    std::ref(range)); });
+    }
+    for(auto &w: workers)
+        w.join();
+
+    size_t passed = 0;
+    size_t total = 0;
+    for(const auto &range: ranges) {
+        for(const auto &e: range.events) {
+            finder.skip(total + e.index - passed);
+            finder(e.type, file.data + e.offset, e.size, e.offset);
+            passed = total + e.index + 1;
+        }
+        total += range.count;
+    }
+    return finder.have;
+}
+
+#ifdef USE_GST
+// The whole mapping through gst_h264_parser_identify_nalu, for comparison.
+template<typename finder_t>
+bool do_mmap_gst(const mapped_file_t &file, finder_t &finder)
+{
+    auto parser = gst_h264_nal_parser_new();
+    size_t base = 0;
+    while(base < file.size) {
+        // the parser keeps offsets and sizes as guint, move data and pass
+        // at most 4 GiB so files larger than that work
+        const unsigned char *data = file.data + base;
+        const size_t size = std::min<size_t>(file.size - base, UINT_MAX);
+        GstH264NalUnit nalu;
+        const auto result = gst_h264_parser_identify_nalu(parser, data, 0,
+                                                          size, &nalu);
+        if(result == GST_H264_PARSER_NO_NAL_END) {
+            if(size == file.size - base) {
+                // last NALU runs to the end of the file
+                finder(nalu.type, data + nalu.offset, nalu.size,
+                       base + nalu.offset);
+                break;
+            }
+            // ends after the window, look again from its start code
+            if(nalu.sc_offset) {
+                base += nalu.sc_offset;
+                continue;
+            }
+            std::cerr << "NALU at " << base << " larger than 4 GiB\n";
+            break;
+        }
+        if(result != GST_H264_PARSER_OK)
+            break;
+        finder(nalu.type, data + nalu.offset, nalu.size, base + nalu.offset);
+        base += nalu.offset + nalu.size;
+    }
     gst_h264_nal_parser_free(parser);
+    return finder.have;
+}
+#endif
+
+// Parameter sets from the avcC boxes of an MP4/MOV file, printed like
+// sprop_finder_t does. One sprop-parameter-sets line per video track.
+bool do_mp4(const mapped_file_t &file)
+{
+    bool have = false;
+    mp4::foreach_avcc(file.data, file.size, [&have](unsigned track,
+                                                    const mp4::avcc_t &avcc) {
+        printf("trak %u: avcC profile %u level %u, nalu length size %u\n",
+               track, avcc.profile_idc, avcc.level_idc, avcc.length_size);
+        std::string sprops;
+        for(const auto *sets: { &avcc.sps, &avcc.pps })
+            for(const auto &set: *sets) {
+                printf("have %s: size=%zu\n", sets == &avcc.sps ? "sps" : "pps",
+                       set.size());
+                dumpv(set);
+                sprops += (sprops.empty() ? "" : ",") + base64encode(set);
+            }
+        if(avcc.sps.empty() || avcc.pps.empty()) {
+            puts("no sps or pps in avcC");
+            return;
+        }
+        printf("sprop-parameter-sets=%s\n\n", sprops.c_str());
+        have = true;
+    });
+    if(!have)
+        std::cerr << "no avcC box with sps and pps found\n";
     return have;
 }
 
+// NAL unit index of an Annex B file, so other tools can seek without
+// scanning. Layout, host byte order, every section 8 byte aligned:
+//
+// header_t
+// entries   per NALU: varint offset - end of the previous NALU, varint
+//           size, NAL header byte, flags
+// points    point_t for every skip_interval-th entry, to start decoding
+//           entries in the middle
+// idrs      unit_t of the first slice of each IDR picture
+// sps       unit_t of each SPS
+//
+// Varints are LEB128. The units lists are sorted by offset.
+namespace nal_index {
+
+const char MAGIC[8] = { 'H', '2', '6', '4', 'N', 'I', 'D', 'X' };
+const uint32_t VERSION = 1;
+const uint32_t SKIP_INTERVAL = 1024;
+
+enum : uint8_t {
+    // slice with first_mb_in_slice 0
+    FIRST_SLICE = 1,
+    // I or SI slice, or IDR
+    INTRA = 2,
+};
+
+struct header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t skip_interval;
+    uint64_t stream_size;
+    uint64_t count;
+    uint64_t entries_offset;
+    uint64_t entries_size;
+    uint64_t points_offset;
+    uint64_t points_count;
+    uint64_t idrs_offset;
+    uint64_t idrs_count;
+    uint64_t sps_offset;
+    uint64_t sps_count;
+};
+
+struct point_t {
+    // into entries
+    uint64_t pos;
+    // end of the NALU before, the delta base
+    uint64_t end;
+};
+
+struct unit_t {
+    uint64_t entry;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct entry_t {
+    uint64_t offset;
+    uint64_t size;
+    uint8_t header;
+    uint8_t flags;
+
+    unsigned type() const { return header & 0x1f; }
+    unsigned ref_idc() const { return header >> 5 & 3; }
+};
+
+inline void put_varint(std::vector<unsigned char> &out, uint64_t v)
+{
+    while(v >= 0x80) {
+        out.push_back(v | 0x80);
+        v >>= 7;
+    }
+    out.push_back(v);
+}
+
+inline bool get_varint(const unsigned char *&p, const unsigned char *end,
+                       uint64_t &v)
+{
+    v = 0;
+    for(unsigned shift = 0; p < end && shift < 64; shift += 7) {
+        const auto b = *p++;
+        v |= uint64_t(b & 0x7f) << shift;
+        if(!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Finder building the index in memory, write() stores it.
+struct writer_t {
+    void operator()(unsigned type, const unsigned char *data, size_t size,
+                    size_t offset)
+    {
+        if(count % SKIP_INTERVAL == 0)
+            points.push_back(point_t { entries.size(), end });
+        uint8_t flags = 0;
+        if(type == 1 || type == 5) {
+            unsigned first_mb, slice_type;
+            if(h264::parse_slice_start(data, size, first_mb, slice_type)) {
+                flags |= first_mb ? 0 : FIRST_SLICE;
+                flags |= h264::is_intra(type, slice_type) ? INTRA : 0;
+            }
+            if(type == 5 && (flags & FIRST_SLICE))
+                idrs.push_back(unit_t { count, offset, size });
+        } else if(type == h264::NAL_SPS) {
+            sps.push_back(unit_t { count, offset, size });
+        }
+        put_varint(entries, offset - end);
+        put_varint(entries, size);
+        entries.push_back(data[0]);
+        entries.push_back(flags);
+        end = offset + size;
+        ++count;
+        have = true;
+    }
+
+    void skip(size_t) {}
+
+    // End of the last NALU, the stream size when it was read from a pipe.
+    uint64_t stream_end() const { return end; }
+
+    bool write(const char *filename, uint64_t stream_size) const
+    {
+        auto align = [](uint64_t v) { return (v + 7) & ~uint64_t(7); };
+        header_t h;
+        memset(&h, 0, sizeof h);
+        memcpy(h.magic, MAGIC, sizeof h.magic);
+        h.version = VERSION;
+        h.skip_interval = SKIP_INTERVAL;
+        h.stream_size = stream_size;
+        h.count = count;
+        h.entries_offset = align(sizeof h);
+        h.entries_size = entries.size();
+        h.points_offset = align(h.entries_offset + h.entries_size);
+        h.points_count = points.size();
+        h.idrs_offset = h.points_offset + points.size() * sizeof(point_t);
+        h.idrs_count = idrs.size();
+        h.sps_offset = h.idrs_offset + idrs.size() * sizeof(unit_t);
+        h.sps_count = sps.size();
+
+        std::ofstream fp(filename, std::ios::binary | std::ios::trunc);
+        const char pad[8] = {};
+        fp.write(reinterpret_cast<const char *>(&h), sizeof h);
+        fp.write(pad, h.entries_offset - sizeof h);
+        fp.write(reinterpret_cast<const char *>(entries.data()), entries.size());
+        fp.write(pad, h.points_offset - h.entries_offset - h.entries_size);
+        fp.write(reinterpret_cast<const char *>(points.data()),
+                 points.size() * sizeof(point_t));
+        fp.write(reinterpret_cast<const char *>(idrs.data()),
+                 idrs.size() * sizeof(unit_t));
+        fp.write(reinterpret_cast<const char *>(sps.data()),
+                 sps.size() * sizeof(unit_t));
+        fp.close();
+        if(!fp) {
+            std::cerr << "writing " << filename << " failed\n";
+            return false;
+        }
+        printf("%s: %zu nal units, %zu idr, %zu sps, %zu bytes\n", filename,
+               count, idrs.size(), sps.size(),
+               size_t(h.sps_offset + sps.size() * sizeof(unit_t)));
+        return true;
+    }
+
+    bool have = false;
+
+private:
+    size_t count = 0;
+    uint64_t end = 0;
+    std::vector<unsigned char> entries;
+    std::vector<point_t> points;
+    std::vector<unit_t> idrs;
+    std::vector<unit_t> sps;
+};
+
+// An index file in a mapping. The sections are used in place.
+class reader_t {
+public:
+    explicit reader_t(const mapped_file_t &file)
+        : file(file), h(nullptr)
+    {
+        if(!file.is_ok() || file.size < sizeof(header_t))
+            return;
+        const auto hdr = reinterpret_cast<const header_t *>(file.data);
+        if(memcmp(hdr->magic, MAGIC, sizeof MAGIC) || hdr->version != VERSION
+           || !hdr->skip_interval)
+            return;
+        if(!in_file(hdr->entries_offset, hdr->entries_size, 1)
+           || !in_file(hdr->points_offset, hdr->points_count, sizeof(point_t))
+           || !in_file(hdr->idrs_offset, hdr->idrs_count, sizeof(unit_t))
+           || !in_file(hdr->sps_offset, hdr->sps_count, sizeof(unit_t))
+           || hdr->points_count
+              < (hdr->count + hdr->skip_interval - 1) / hdr->skip_interval)
+            return;
+        h = hdr;
+    }
+
+    bool is_ok() const { return h != nullptr; }
+    const header_t &header() const { return *h; }
+
+    // n-th NALU: from the point before it, decoding at most
+    // skip_interval - 1 entries
+    bool nal(uint64_t n, entry_t &e) const
+    {
+        if(n >= h->count)
+            return false;
+        const auto &pt = points()[n / h->skip_interval];
+        const unsigned char *p = file.data + h->entries_offset + pt.pos;
+        const unsigned char *end = file.data + h->entries_offset
+            + h->entries_size;
+        uint64_t last_end = pt.end;
+        for(uint64_t i = n / h->skip_interval * h->skip_interval; i <= n; i++) {
+            uint64_t delta;
+            if(!get_varint(p, end, delta) || !get_varint(p, end, e.size)
+               || end - p < 2)
+                return false;
+            e.offset = last_end + delta;
+            e.header = *p++;
+            e.flags = *p++;
+            last_end = e.offset + e.size;
+        }
+        return true;
+    }
+
+    const unit_t *idr(uint64_t n) const
+    {
+        return n < h->idrs_count ? &idrs()[n] : nullptr;
+    }
+
+    // last SPS at or before offset
+    const unit_t *sps_at(uint64_t offset) const
+    {
+        const auto begin = sps(), end = sps() + h->sps_count;
+        const auto it = std::upper_bound(
+            begin, end, offset, [](uint64_t off, const unit_t &u) {
+                return off < u.offset; });
+        return it == begin ? nullptr : it - 1;
+    }
+
+private:
+    bool in_file(uint64_t offset, uint64_t count, uint64_t size) const
+    {
+        return offset % 8 == 0 && offset <= file.size
+            && count <= (file.size - offset) / size;
+    }
+
+    const point_t *points() const
+    {
+        return reinterpret_cast<const point_t *>(file.data + h->points_offset);
+    }
+
+    const unit_t *idrs() const
+    {
+        return reinterpret_cast<const unit_t *>(file.data + h->idrs_offset);
+    }
+
+    const unit_t *sps() const
+    {
+        return reinterpret_cast<const unit_t *>(file.data + h->sps_offset);
+    }
+
+    const mapped_file_t &file;
+    const header_t *h;
+};
+
+inline void print(uint64_t n, const entry_t &e)
+{
+    printf("nal %llu: offset %llu, size %llu, type %u, ref_idc %u%s%s\n",
+           (unsigned long long)n, (unsigned long long)e.offset,
+           (unsigned long long)e.size, e.type(), e.ref_idc(),
+           e.flags & FIRST_SLICE ? ", first slice" : "",
+           e.flags & INTRA ? ", intra" : "");
+}
+
+// lookup <index> idr <n> | sps <offset> | nal <n>
+inline bool lookup(const char *filename, const std::string &what,
+                   uint64_t arg)
+{
+    const mapped_file_t file(filename);
+    const reader_t index(file);
+    if(!index.is_ok()) {
+        std::cerr << filename << ": not a nal index\n";
+        return false;
+    }
+    entry_t e = {};
+    if(what == "nal") {
+        if(!index.nal(arg, e)) {
+            std::cerr << "no nal " << arg << "\n";
+            return false;
+        }
+        print(arg, e);
+        return true;
+    }
+
+    const unit_t *u = nullptr;
+    if(what == "idr") {
+        u = index.idr(arg);
+        if(!u) {
+            std::cerr << "no idr " << arg << ", "
+                      << index.header().idrs_count << " in index\n";
+            return false;
+        }
+        if(!index.nal(u->entry, e))
+            return false;
+        print(u->entry, e);
+        // what a decoder starting there needs
+        u = index.sps_at(u->offset);
+        if(!u)
+            return true;
+    } else if(what == "sps") {
+        u = index.sps_at(arg);
+        if(!u) {
+            std::cerr << "no sps before offset " << arg << "\n";
+            return false;
+        }
+    } else {
+        std::cerr << "unknown lookup " << what << "\n";
+        return false;
+    }
+    if(!index.nal(u->entry, e))
+        return false;
+    print(u->entry, e);
+    return true;
+}
+
+}
+
+// Copies byte ranges of in to out inside the kernel: copy_file_range
+// between files, splice through a pipe where that fails (out a pipe,
+// kernels without cross file system support).
+class copier_t {
+public:
+    copier_t(int in, int out) : in(in), out(out) {}
+
+    ~copier_t()
+    {
+        for(const auto fd: pipe)
+            if(fd != -1)
+                close(fd);
+    }
+
+    copier_t(const copier_t &) = delete;
+    copier_t &operator=(const copier_t &) = delete;
+
+    bool copy(uint64_t offset, uint64_t len)
+    {
+        loff_t off = offset;
+        while(len && use_copy_file_range) {
+            const auto n = copy_file_range(in, &off, out, nullptr, len, 0);
+            if(n > 0) {
+                len -= n;
+            } else if(n == 0) {
+                std::cerr << "copy_file_range: unexpected end of input\n";
+                return false;
+            } else if(errno == EXDEV || errno == EINVAL || errno == ENOSYS
+                      || errno == EOPNOTSUPP || errno == EBADF) {
+                use_copy_file_range = false;
+            } else if(errno != EINTR) {
+                perror("copy_file_range");
+                return false;
+            }
+        }
+        while(len) {
+            if(pipe[0] == -1 && pipe2(pipe, O_CLOEXEC) == -1) {
+                perror("pipe2");
+                return false;
+            }
+            auto n = splice(in, &off, pipe[1], nullptr, len,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(n <= 0) {
+                if(n == -1 && errno == EINTR)
+                    continue;
+                perror("splice");
+                return false;
+            }
+            len -= n;
+            while(n) {
+                const auto m = splice(pipe[0], nullptr, out, nullptr, n,
+                                      SPLICE_F_MOVE | SPLICE_F_MORE);
+                if(m <= 0) {
+                    if(m == -1 && errno == EINTR)
+                        continue;
+                    perror("splice");
+                    return false;
+                }
+                n -= m;
+            }
+        }
+        return true;
+    }
+
+    // start codes
+    bool write(const void *data, size_t len)
+    {
+        if(::write(out, data, len) != ssize_t(len)) {
+            perror("write");
+            return false;
+        }
+        return true;
+    }
+
+private:
+    int in;
+    int out;
+    int pipe[2] = { -1, -1 };
+    bool use_copy_file_range = true;
+};
+
+// What --extract keeps: NAL types, a byte range or a stream time range.
+struct selection_t {
+    // bit per NAL type, 0: none
+    uint32_t types = 0;
+    // --bytes
+    bool bytes = false;
+    uint64_t from_byte = 0;
+    uint64_t to_byte = UINT64_MAX;
+    // --seconds
+    bool seconds = false;
+    double from_s = 0;
+    double to_s = HUGE_VAL;
+};
+
+// Writes the selected NALUs of a mapped Annex B file to out. Consecutive
+// selected units are copied as one range, start codes and all. The cut
+// begins with the SPS and PPS in effect unless it starts with a SPS
+// itself, and those two go into a sprop-parameter-sets line.
+//
+// Time ranges count pictures at the SPS frame rate and start at the first
+// IDR picture in the range, so the cut decodes on its own. Units before a
+// picture's first slice (AUD, SPS, PPS, SEI) belong to that picture and
+// wait in pending until it is known.
+struct extractor_t {
+    extractor_t(const mapped_file_t &file, const selection_t &sel,
+                copier_t &copier)
+        : file(file), sel(sel), copier(copier) {}
+
+    void operator()(unsigned type, const unsigned char *data, size_t size,
+                    size_t offset)
+    {
+        if(!ok)
+            return;
+        if(type == h264::NAL_SPS) {
+            h264::sps_t sps;
+            if(h264::parse_sps(data, size, sps) && sps.fps() > 0)
+                fps = sps.fps();
+        }
+
+        if(sel.types) {
+            // parameter sets are always kept, the slices need them
+            emit(type, offset, size, (sel.types >> type & 1)
+                 || type == h264::NAL_SPS || type == h264::NAL_PPS);
+        } else if(!sel.seconds) {
+            emit(type, offset, size,
+                 offset >= sel.from_byte && offset < sel.to_byte);
+        } else if(type != 1 && type != 5) {
+            pending.push_back(unit_t { type, offset, size });
+        } else {
+            unsigned first_mb, slice_type;
+            if(h264::parse_slice_start(data, size, first_mb, slice_type)
+               && !first_mb) {
+                if(!in_cut && !done && type == 5 && time >= sel.from_s
+                   && time < sel.to_s) {
+                    in_cut = true;
+                    // the picture brings its own
+                    for(const auto &u: pending)
+                        if(u.type == h264::NAL_SPS)
+                            need_sets = false;
+                } else if(in_cut && time >= sel.to_s) {
+                    in_cut = false;
+                    done = true;
+                }
+                time += fps ? 1 / fps : 0;
+            }
+            for(const auto &u: pending)
+                emit(u.type, u.offset, u.size, in_cut);
+            pending.clear();
+            emit(type, offset, size, in_cut);
+        }
+        // the ones in effect for the next cut
+        if(type == h264::NAL_SPS) {
+            sps = unit_t { type, offset, size };
+            pps.size = 0;
+        } else if(type == h264::NAL_PPS) {
+            pps = unit_t { type, offset, size };
+        }
+    }
+
+    // Remaining units, the sprop line. Messages go to log. false if
+    // nothing was selected.
+    bool finish(const std::string &sprop_file, FILE *log)
+    {
+        for(const auto &u: pending)
+            emit(u.type, u.offset, u.size, in_cut);
+        pending.clear();
+        flush();
+        if(!ok)
+            return false;
+        if(!bytes) {
+            std::cerr << "nothing selected\n";
+            return false;
+        }
+        if(sel.seconds && !fps)
+            std::cerr << "warning: no timing info in sps, 0 fps\n";
+        fprintf(log, "%zu nal units, %llu bytes\n", units,
+                (unsigned long long)bytes);
+        if(!sprop_sps.size || !sprop_pps.size) {
+            fputs("no sps and pps in cut\n", log);
+            return true;
+        }
+        const auto sps_data = file.data + sprop_sps.offset;
+        const auto pps_data = file.data + sprop_pps.offset;
+        const std::string line = "sprop-parameter-sets="
+            + base64encode(std::vector<unsigned char>(
+                               sps_data, sps_data + sprop_sps.size)) + ","
+            + base64encode(std::vector<unsigned char>(
+                               pps_data, pps_data + sprop_pps.size));
+        if(sprop_file.empty()) {
+            fprintf(log, "%s\n", line.c_str());
+            return true;
+        }
+        std::ofstream fp(sprop_file);
+        fp << line << "\n";
+        fp.close();
+        if(!fp) {
+            std::cerr << "writing " << sprop_file << " failed\n";
+            return false;
+        }
+        fprintf(log, "%s: %s\n", sprop_file.c_str(), line.c_str());
+        return true;
+    }
+
+private:
+    struct unit_t {
+        unsigned type;
+        size_t offset;
+        size_t size;
+    };
+
+    static constexpr unsigned char START_CODE[4] = { 0, 0, 0, 1 };
+
+    void emit(unsigned type, size_t offset, size_t size, bool selected)
+    {
+        if(!selected) {
+            flush();
+            return;
+        }
+        // the sets go after a leading AUD, which must come first
+        if(need_sets && type != h264::NAL_AUD) {
+            need_sets = false;
+            if(type != h264::NAL_SPS && sps.size && pps.size) {
+                flush();
+                ok = ok && copier.write(START_CODE, 4)
+                    && copier.copy(sps.offset, sps.size)
+                    && copier.write(START_CODE, 4)
+                    && copier.copy(pps.offset, pps.size);
+                bytes += 8 + sps.size + pps.size;
+                units += 2;
+                sprop_sps = sps;
+                sprop_pps = pps;
+            }
+        }
+        if(!sprop_pps.size) {
+            if(type == h264::NAL_SPS)
+                sprop_sps = unit_t { type, offset, size };
+            else if(type == h264::NAL_PPS && sprop_sps.size)
+                sprop_pps = unit_t { type, offset, size };
+        }
+        ++units;
+        // from the 00 00 01 in front
+        if(run_end == run_begin)
+            run_begin = offset - 3;
+        run_end = offset + size;
+    }
+
+    void flush()
+    {
+        if(run_end == run_begin)
+            return;
+        if(ok)
+            ok = copier.copy(run_begin, run_end - run_begin);
+        bytes += run_end - run_begin;
+        run_begin = run_end = 0;
+    }
+
+    const mapped_file_t &file;
+    const selection_t &sel;
+    copier_t &copier;
+    bool ok = true;
+    // SPS and PPS still to be put in front of the cut
+    bool need_sets = true;
+    size_t units = 0;
+    uint64_t bytes = 0;
+    size_t run_begin = 0;
+    size_t run_end = 0;
+    unit_t sps = {};
+    unit_t pps = {};
+    unit_t sprop_sps = {};
+    unit_t sprop_pps = {};
+    double fps = 0;
+    double time = 0;
+    bool in_cut = false;
+    bool done = false;
+    std::vector<unit_t> pending;
+};
+
+constexpr unsigned char extractor_t::START_CODE[4];
+
+// --extract <out>: "-" is stdout, then the sprop line is printed to
+// stderr instead of written to <out>.sprop.
+bool do_extract(const mapped_file_t &file, const std::string &out,
+                const selection_t &sel)
+{
+    const bool to_stdout = out == "-";
+    const int fd = to_stdout ? STDOUT_FILENO
+        : open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1) {
+        perror(("open " + out).c_str());
+        return false;
+    }
+    copier_t copier(file.fd, fd);
+    extractor_t extractor(file, sel, copier);
+    annexb::foreach_nal(file.data, file.size, true,
+                        [&extractor, &file](const annexb::nal_t &nal) {
+                            extractor(nal.type, file.data + nal.offset,
+                                      nal.size, nal.offset); });
+    // the summary must not end up in the cut
+    bool ok = to_stdout ? extractor.finish("", stderr)
+                        : extractor.finish(out + ".sprop", stdout);
+    if(!to_stdout && close(fd) == -1) {
+        perror("close");
+        ok = false;
+    }
+    return ok;
+}
+
+struct opt_t {
+    std::string input;
+    // scan with gst_h264_parser_identify_nalu instead of annexb::
+    bool gst {false};
+    // only distinct SPS/PPS pairs and a summary
+    bool unique {false};
+    // counters over all NALUs instead of the SPS/PPS
+    bool stats {false};
+    // scan threads for mapped files
+    unsigned threads {1};
+    // captures: follow this RTP stream, only this UDP port
+    bool has_ssrc {false};
+    uint32_t ssrc {0};
+    unsigned port {0};
+    // write a nal_index file
+    std::string index;
+    // lookup <index> <what> <arg>, input is the index
+    std::string lookup;
+    uint64_t lookup_arg {0};
+    // cut sel to this file
+    std::string extract;
+    selection_t sel;
+};
+
+// RTP packets from a capture to finder. Without --ssrc the first stream
+// that sends a SPS is followed, --port only looks at datagrams from or to
+// that port. The other RTP streams are listed at the end.
+template<typename finder_t>
+bool do_pcap(const mapped_file_t &file, const opt_t &opts, finder_t &finder)
+{
+    struct stream_t {
+        unsigned src_port;
+        unsigned dst_port;
+        unsigned payload_type;
+        size_t packets;
+    };
+    std::map<uint32_t, stream_t> streams;
+    bool follow = opts.has_ssrc;
+    uint32_t ssrc = opts.ssrc;
+    pcap::depacketizer_t<finder_t> depay(finder);
+
+    pcap::foreach_packet(file.data, file.size, [&](unsigned linktype,
+                                                   const unsigned char *p,
+                                                   size_t len) {
+        pcap::udp_t udp;
+        pcap::rtp_t rtp;
+        if(!pcap::parse_udp(linktype, p, len, udp)
+           || !pcap::parse_rtp(udp.payload, udp.size, rtp))
+            return;
+        if(opts.port && udp.src_port != opts.port && udp.dst_port != opts.port)
+            return;
+        auto it = streams.find(rtp.ssrc);
+        if(it == streams.end())
+            it = streams.emplace(rtp.ssrc, stream_t { udp.src_port, udp.dst_port,
+                                                      rtp.payload_type, 0 }).first;
+        ++it->second.packets;
+
+        if(!follow && pcap::has_sps(rtp)) {
+            follow = true;
+            ssrc = rtp.ssrc;
+        }
+        if(!follow || rtp.ssrc != ssrc)
+            return;
+        if(!depay.packets)
+            printf("rtp ssrc 0x%08x, udp port %u -> %u, payload type %u\n\n",
+                   rtp.ssrc, udp.src_port, udp.dst_port, rtp.payload_type);
+        depay(rtp, rtp.payload - file.data);
+    });
+
+    if(streams.empty()) {
+        std::cerr << "no rtp packets in capture\n";
+        return false;
+    }
+    for(const auto &s: streams) {
+        printf("ssrc 0x%08x: udp port %u -> %u, payload type %u, %zu packets",
+               s.first, s.second.src_port, s.second.dst_port,
+               s.second.payload_type, s.second.packets);
+        if(follow && s.first == ssrc)
+            printf(", %zu lost, followed", depay.lost);
+        puts("");
+    }
+    return finder.have;
+}
+
+template<typename finder_t>
+bool scan(const opt_t &opts, const mapped_file_t &file, finder_t &finder)
+{
+    if(!file.is_ok())
+        return do_blockwise(opts.input.c_str(), finder);
+    if(pcap::is_pcap(file.data, file.size))
+        return do_pcap(file, opts, finder);
+#ifdef USE_GST
+    if(opts.gst)
+        return do_mmap_gst(file, finder);
+#endif
+    if(opts.threads > 1)
+        return do_mmap_parallel(file, finder, opts.threads);
+    return do_mmap(file, finder);
+}
 
 void usage(const char *arg0)
 {
-    std::cout << "Usage: " << arg0 << "<sprop-parameter-sets>|<file_with_annex_b_h264_bytestream>\n";
+    std::cout << "Usage: " << arg0 <<
+#ifdef USE_GST
+        " [--gst]"
+#endif
+        " [--unique|--stats] [--threads <n>] [--ssrc <n>] [--port <n>]\n"
+        " [--index <index_file>]\n"
+        "       [--extract <out>|- --types <t,...>|--bytes <from>-<to>|--seconds <from>-<to>]\n"
+        "       <sprop-parameter-sets>|<file_with_annex_b_h264_bytestream>|<mp4_file>|<pcap_file>\n"
+        "       " << arg0 << " lookup <index_file> idr <n>|sps <offset>|nal <n>\n";
+}
+
+// All of s as a number. No sign, the dash separates the range.
+bool parse_u64(const std::string &s, uint64_t &v)
+{
+    if(s.empty() || !isdigit((unsigned char)s[0]))
+        return false;
+    char *end;
+    errno = 0;
+    v = strtoull(s.c_str(), &end, 0);
+    return !*end && errno != ERANGE;
+}
+
+bool parse_seconds(const std::string &s, double &v)
+{
+    if(s.empty() || !(isdigit((unsigned char)s[0]) || s[0] == '.'))
+        return false;
+    char *end;
+    v = strtod(s.c_str(), &end);
+    return !*end && std::isfinite(v);
+}
+
+// --bytes or --seconds <from>-<to>. An empty from is the start, an empty
+// to the end of the stream: "0-", "-1000".
+bool parse_range(const char *arg, bool bytes, selection_t &sel)
+{
+    const char *dash = strchr(arg, '-');
+    if(!dash)
+        return false;
+    const std::string from(arg, dash), to(dash + 1);
+    if(bytes) {
+        sel.bytes = true;
+        return (from.empty() || parse_u64(from, sel.from_byte))
+            && (to.empty() || parse_u64(to, sel.to_byte))
+            && sel.from_byte < sel.to_byte;
+    }
+    sel.seconds = true;
+    return (from.empty() || parse_seconds(from, sel.from_s))
+        && (to.empty() || parse_seconds(to, sel.to_s))
+        && sel.from_s < sel.to_s;
+}
+
+std::pair<bool, opt_t> parse_args(int argc, char *argv[])
+{
+    opt_t ret;
+    if(argc == 5 && strcmp(argv[1], "lookup") == 0) {
+        ret.input.assign(argv[2]);
+        ret.lookup.assign(argv[3]);
+        if(ret.lookup != "idr" && ret.lookup != "sps" && ret.lookup != "nal") {
+            std::cerr << "unknown lookup " << ret.lookup << "\n";
+            return std::make_pair(false, ret);
+        }
+        if(!parse_u64(argv[4], ret.lookup_arg)) {
+            std::cerr << "bad number " << argv[4] << "\n";
+            return std::make_pair(false, ret);
+        }
+        return std::make_pair(true, ret);
+    }
+    for(int i = 1; i < argc; i++) {
+#ifdef USE_GST
+        if(strcmp(argv[i], "--gst") == 0) {
+            ret.gst = true;
+            continue;
+        }
+#endif
+        if(strcmp(argv[i], "--unique") == 0) {
+            ret.unique = true;
+            continue;
+        }
+        if(strcmp(argv[i], "--stats") == 0) {
+            ret.stats = true;
+            continue;
+        }
+        if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            // 0: one per cpu
+            ret.threads = std::atoi(argv[++i]);
+            if(!ret.threads)
+                ret.threads = std::max(1u, std::thread::hardware_concurrency());
+            continue;
+        }
+        if(strcmp(argv[i], "--ssrc") == 0 && i + 1 < argc) {
+            ret.has_ssrc = true;
+            ret.ssrc = strtoul(argv[++i], nullptr, 0);
+            continue;
+        }
+        if(strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            ret.port = std::atoi(argv[++i]);
+            continue;
+        }
+        if(strcmp(argv[i], "--index") == 0 && i + 1 < argc) {
+            ret.index.assign(argv[++i]);
+            continue;
+        }
+        if(strcmp(argv[i], "--extract") == 0 && i + 1 < argc) {
+            ret.extract.assign(argv[++i]);
+            continue;
+        }
+        if(strcmp(argv[i], "--types") == 0 && i + 1 < argc) {
+            // 5,7,8
+            for(char *p = argv[++i]; *p;) {
+                char *end;
+                const auto t = strtoul(p, &end, 0);
+                if(end == p || t > 31 || (*end && *end != ','))
+                    return std::make_pair(false, ret);
+                ret.sel.types |= 1u << t;
+                p = *end ? end + 1 : end;
+            }
+            continue;
+        }
+        if((strcmp(argv[i], "--bytes") == 0 || strcmp(argv[i], "--seconds") == 0)
+           && i + 1 < argc) {
+            const bool bytes = argv[i][2] == 'b';
+            if(!parse_range(argv[++i], bytes, ret.sel)) {
+                std::cerr << "bad range " << argv[i] << "\n";
+                return std::make_pair(false, ret);
+            }
+            continue;
+        }
+        if(!ret.input.empty())
+            return std::make_pair(false, ret);
+        ret.input.assign(argv[i]);
+    }
+    // one kind of selection with --extract
+    const int selections = !!ret.sel.types + ret.sel.bytes + ret.sel.seconds;
+    if(ret.extract.empty() ? selections : selections != 1)
+        return std::make_pair(false, ret);
+    return std::make_pair(!ret.input.empty(), ret);
 }
 
 int main(int argc, char *argv[])
@@ -263,22 +2695,82 @@ int main(int argc, char *argv[])
         decode_sprops(s);
 #else
 
-    if(argc != 2) {
+    const auto opts = parse_args(argc, argv);
+    if(!opts.first) {
         usage(argv[0]);
         exit(EXIT_FAILURE);
     }
+    const char *input = opts.second.input.c_str();
+    if(!opts.second.lookup.empty())
+        exit(nal_index::lookup(input, opts.second.lookup,
+                               opts.second.lookup_arg)
+             ? EXIT_SUCCESS : EXIT_FAILURE);
 
     bool ok = false;
 
     struct stat s;
-    const auto err = ::stat(argv[1], &s);
+    const auto err = ::stat(input, &s);
     if(err == -1) {
         if(!(errno == EACCES || errno == ENOENT))
             perror("stat");
         else
-            ok = decode_sprops(argv[1]);
+            ok = decode_sprops(input);
     } else {
-        ok = do_blockwise(argv[1]);
+        const mapped_file_t file(input);
+        if(!opts.second.extract.empty()) {
+            if(!file.is_ok() || mp4::is_mp4(file.data, file.size)
+               || pcap::is_pcap(file.data, file.size)) {
+                std::cerr << "can only extract from annex b files\n";
+                exit(EXIT_FAILURE);
+            }
+            // errors are reported there, the usage would not help
+            exit(do_extract(file, opts.second.extract, opts.second.sel)
+                 ? EXIT_SUCCESS : EXIT_FAILURE);
+        } else if(file.is_ok() && mp4::is_mp4(file.data, file.size)) {
+            // only the avcC boxes are read from MP4 files
+            if(!opts.second.index.empty()) {
+                std::cerr << "can only index annex b streams\n";
+                exit(EXIT_FAILURE);
+            }
+            if(opts.second.unique) {
+                std::cerr << "--unique needs an annex b stream or a pcap\n";
+                exit(EXIT_FAILURE);
+            }
+            if(opts.second.stats) {
+                std::cerr << "--stats needs an annex b stream or a pcap\n";
+                exit(EXIT_FAILURE);
+            }
+            ok = do_mp4(file);
+        } else if(!opts.second.index.empty()) {
+            // offsets only mean something in a byte stream
+            if(file.is_ok() && pcap::is_pcap(file.data, file.size)) {
+                std::cerr << "can only index annex b streams\n";
+                exit(EXIT_FAILURE);
+            }
+            auto o = opts.second;
+            o.threads = 1;
+            nal_index::writer_t writer;
+            // st_size is 0 for pipes
+            ok = scan(o, file, writer)
+                && writer.write(opts.second.index.c_str(),
+                                file.is_ok() ? file.size : writer.stream_end());
+        } else if(opts.second.stats) {
+            // every NALU in order, the threads only pass on SPS and PPS
+            auto o = opts.second;
+            o.threads = 1;
+            stats_t stats;
+            ok = scan(o, file, stats);
+            if(ok)
+                stats.summary();
+        } else if(opts.second.unique) {
+            config_table_t table;
+            ok = scan(opts.second, file, table);
+            if(ok)
+                table.summary();
+        } else {
+            sprop_finder_t finder;
+            ok = scan(opts.second, file, finder);
+        }
     }
 
     if(!ok) {
@@ -7,409 +7,1534 @@ Usage example:
 sudo perf top -p $(/opt/usr/bin/spidof h264dec)
 htop -p $(/opt/usr/bin/spidof h264dec)
 
+Several names or patterns, printed as "<name> <pid>" per match. --all exits
+once each of them was seen, --file reads names one per line:
+spidof --all h264dec exact:gst-launch-1.0 'glob:*enc' 'regex:^v4l2(src|sink)$'
+
+To not miss the startup of the process, --stop sends SIGSTOP right after the
+exec event and --exec runs a command with {} replaced by the pid. The target
+is continued once the command sends SIGUSR1 to spidof ($PPID), exits, or
+after --ready-delay ms:
+spidof --stop --ready-delay 300 h264dec --exec perf record -g -p {}
+Without --exec the target is continued after --ready-delay ms or when
+spidof gets SIGUSR1.
+
+--wait-exit also waits for the matched processes to exit, through a pidfd.
+--follow-respawn then keeps waiting for the next instance. Both print exec
+and exit with CLOCK_MONOTONIC timestamps, lifetime and respawn gap:
+spidof --follow-respawn h264dec
+1247.081451614 exec h264dec 7187
+1247.482421308 exit h264dec 7187 lifetime 0.400969694
+1247.686186948 exec h264dec 7189 gap 0.203765640
+
+--cgroup restricts the wait to the processes of a cgroup v2 directory and
+its children. It needs no privileges and sleeps in inotify while the
+cgroup is empty, however busy the rest of the machine is:
+spidof --cgroup /sys/fs/cgroup/system.slice/h264dec.service h264dec
+
+--poll skips the proc connector. --comm-only subscribes to renames via
+prctl(PR_SET_NAME) only, exec events are then dropped in the kernel. See
+spidof_bench.cc for what each costs.
+
+Daemon mode keeps a process table current from proc connector events and
+answers queries over a unix socket ($XDG_RUNTIME_DIR/spidof.sock or
+/tmp/spidof-<uid>/spidof.sock). Both ends only talk to the same user or
+root. If a daemon is running, spidof <name> asks it instead of subscribing
+and scanning /proc itself:
+spidof --daemon &
+spidof h264dec
+
+Protocol, one request per connection:
+"lookup <name>\n"           -> "<pid> <pid> ...\n"
+"wait <name> <timeout_ms>\n" -> "<pid>\n" or "\n" on timeout, at most 600 s
+
 */
 
+extern "C" {
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <regex.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
 #include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <fstream>
+#include <ctime>
 #include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
 #include <string>
 #include <thread>
-#include <experimental/filesystem>
+#include <unordered_map>
+#include <vector>
 
-#ifdef USE_PROC_CONN
-// Employ proc connector API to reduce need for polling /proc.
+#include "spidof.hh"
 
-extern "C" {
-#include <linux/cn_proc.h>
-#include <arpa/inet.h>
-#include <linux/filter.h>
-#include <linux/netlink.h>
-#include <linux/connector.h>
-#include <sys/poll.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <unistd.h>
-#include <sys/capability.h>
-}
+namespace {
 
-#include <cassert>
-#include <fstream>
-#include <vector>
+using namespace spidof;
 
-namespace {
+// The names to wait for. A plain name matches if the basename of argv[0]
+// starts with it. "exact:<name>", "glob:<pattern>" (fnmatch) and
+// "regex:<ere>" select other kinds of matches. Plain and exact names are
+// found by hashing the basename (prefixes of the lengths in use), so the
+// cost per event does not grow with the number of names.
+class name_set_t {
+public:
+    name_set_t() = default;
+    name_set_t(const name_set_t &) = delete;
+    name_set_t &operator=(const name_set_t &) = delete;
+
+    ~name_set_t()
+    {
+        for(auto &r: regexes)
+            regfree(&r.second);
+    }
 
-// Filter out all non-relevant messages in the kernel.
-void filter(int sock)
+    bool add(const std::string &spec)
+    {
+        if(spec.empty())
+            return false;
+        const auto idx = specs.size();
+        if(startswith(spec, "exact:")) {
+            const auto name = spec.substr(6);
+            exact[hash(name.data(), name.length())].push_back(idx);
+            keys.push_back(name);
+        } else if(startswith(spec, "glob:")) {
+            globs.emplace_back(idx, spec.substr(5));
+            keys.push_back("");
+        } else if(startswith(spec, "regex:")) {
+            regexes.emplace_back(idx, regex_t());
+            if(regcomp(&regexes.back().second, spec.c_str() + 6,
+                       REG_EXTENDED | REG_NOSUB) != 0) {
+                regexes.pop_back();
+                std::cerr << "invalid regex: " << spec << "\n";
+                return false;
+            }
+            keys.push_back("");
+        } else {
+            prefix[hash(spec.data(), spec.length())].push_back(idx);
+            if(std::find(prefix_lens.begin(), prefix_lens.end(), spec.length())
+               == prefix_lens.end())
+                prefix_lens.push_back(spec.length());
+            keys.push_back(spec);
+        }
+        specs.push_back(spec);
+        return true;
+    }
+
+    // One name per line, empty lines and lines starting with # are skipped.
+    bool load(const char *path)
+    {
+        FILE *f = fopen(path, "re");
+        if(!f) {
+            perror(path);
+            return false;
+        }
+        char line[4096];
+        bool ret = true;
+        while(ret && fgets(line, sizeof line, f)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if(line[0] != '\0' && line[0] != '#')
+                ret = add(line);
+        }
+        fclose(f);
+        return ret;
+    }
+
+    // Calls cb(index) for each name matching base.
+    template<typename lambda_t>
+    void match(const char *base, lambda_t cb) const
+    {
+        const size_t len = strlen(base);
+        lookup(exact, base, len, cb);
+        for(const auto l: prefix_lens)
+            if(l <= len)
+                lookup(prefix, base, l, cb);
+        for(const auto &g: globs)
+            if(fnmatch(g.second.c_str(), base, 0) == 0)
+                cb(g.first);
+        for(const auto &r: regexes)
+            if(regexec(&r.second, base, 0, nullptr, 0) == 0)
+                cb(r.first);
+    }
+
+    // Names that can be compared against comm in the kernel, empty if
+    // there are patterns that can not.
+    std::vector<std::string> comms() const
+    {
+        if(!globs.empty() || !regexes.empty())
+            return {};
+        return keys;
+    }
+
+    size_t size() const { return specs.size(); }
+
+    std::vector<std::string> specs;
+
+private:
+    typedef std::unordered_map<uint64_t, std::vector<size_t>> table_t;
+
+    static bool startswith(const std::string &s, const char *prefix)
+    {
+        return s.compare(0, strlen(prefix), prefix) == 0;
+    }
+
+    static uint64_t hash(const char *data, size_t len)
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for(size_t i = 0; i < len; i++)
+            h = (h ^ (unsigned char)data[i]) * 0x100000001b3ull;
+        return h;
+    }
+
+    // Names in t equal to the first len bytes of base.
+    template<typename lambda_t>
+    void lookup(const table_t &t, const char *base, size_t len,
+                lambda_t &cb) const
+    {
+        if(t.empty())
+            return;
+        const auto it = t.find(hash(base, len));
+        if(it == t.end())
+            return;
+        for(const auto idx: it->second) {
+            const auto &key = keys[idx];
+            if(key.length() == len && memcmp(key.data(), base, len) == 0)
+                cb(idx);
+        }
+    }
+
+    table_t exact;
+    table_t prefix;
+    std::vector<size_t> prefix_lens;
+    // name for plain and exact: specs, empty for patterns
+    std::vector<std::string> keys;
+    std::vector<std::pair<size_t, std::string>> globs;
+    std::list<std::pair<size_t, regex_t>> regexes;
+};
+
+uint64_t monotonic_ns()
 {
-    // return amount of bytes of the packet
-    // context: | struct nlmsghdr | struct cn_msg | struct proc_event ... |
-    struct sock_filter f[] = {
-        // 1. return all if type != NLMSG_DONE
-        BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
-                 __builtin_offsetof(struct nlmsghdr, nlmsg_type)),
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(NLMSG_DONE), 1, 0),
-        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
-
-        // 2. return all if cn_msg::id::idx != CN_IDX_PROC
-        // load 32bit id from absolute address given in argument
-        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
-                 // skip nlmsghdr
-                 NLMSG_LENGTH(0)
-                 // add offset to: cn_msg::id::idx
-                 + __builtin_offsetof(struct cn_msg, id)
-                 + __builtin_offsetof(struct cb_id, idx)),
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(CN_IDX_PROC), 1, 0),
-        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
-
-        // 3. return all if cn_msg::id::val != CN_VAL_PROC
-        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
-                 NLMSG_LENGTH(0) + __builtin_offsetof(struct cn_msg, id)
-                 + __builtin_offsetof(struct cb_id, val)),
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(CN_VAL_PROC), 1, 0),
-        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
-
-        // packet contains 1 netlink msg from proc_cn
-
-        // 4. if proc_event type is not PROC_EVENT_EXEC, throw away packet
-        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
-                 NLMSG_LENGTH(0) + __builtin_offsetof(struct cn_msg, data)
-                 + __builtin_offsetof(struct proc_event, what)),
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(proc_event::PROC_EVENT_EXEC), 1, 0),
-        BPF_STMT(BPF_RET | BPF_K, 0),
-        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// --exec: runs cmd with "{}" replaced by the pid of each match. With the
+// target stopped, the target is continued after the command sent SIGUSR1
+// to its parent, after ready_ms or when the command exits, whatever comes
+// first. With an empty cmd only stopped targets are held, until ready_ms
+// or SIGUSR1. A thread takes the signals and reaps the commands, so other
+// names are still detected meanwhile. SIGUSR1 and SIGCHLD must be blocked
+// by the caller before the first start(). The destructor waits for the
+// commands.
+class attacher_t {
+public:
+    attacher_t(const std::vector<std::string> &cmd, int ready_ms)
+        : cmd(cmd), ready_ms(ready_ms), quit(false)
+    {
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        sigaddset(&signals, SIGCHLD);
+    }
+
+    ~attacher_t()
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            quit = true;
+        }
+        if(thread.joinable()) {
+            wake();
+            thread.join();
+        }
+    }
+
+    attacher_t(const attacher_t &) = delete;
+    attacher_t &operator=(const attacher_t &) = delete;
+
+    void start(pid_t pid, bool stopped)
+    {
+        if(cmd.empty() && !stopped)
+            return;
+        const auto p = std::to_string(pid);
+        std::vector<std::string> args(cmd);
+        std::vector<char *> argv;
+        for(auto &a: args) {
+            for(auto pos = a.find("{}"); pos != std::string::npos;
+                pos = a.find("{}", pos + p.length()))
+                a.replace(pos, 2, p);
+            argv.push_back(&a[0]);
+        }
+        argv.push_back(nullptr);
+
+        std::lock_guard<std::mutex> guard(mutex);
+        // a SIGUSR1 or SIGCHLD already pending belongs to an earlier command
+        drain();
+        // -1: nothing to run, only the target to continue
+        pid_t child = -1;
+        if(!cmd.empty() && !spawn(argv, child)) {
+            if(stopped)
+                kill(pid, SIGCONT);
+            return;
+        }
+
+        const auto now = monotonic_ns();
+        cmds.push_back(cmd_t {child, pid, stopped, now,
+                              now + ready_ms * 1000000ull});
+        if(thread.joinable())
+            wake();
+        else
+            thread = std::thread(&attacher_t::run, this);
+    }
+
+private:
+    struct cmd_t {
+        pid_t child;
+        pid_t target;
+        // target not continued yet
+        bool stopped;
+        uint64_t t0;
+        uint64_t deadline;
     };
 
-    struct sock_fprog fprog;
-    fprog.filter = f;
-    fprog.len = sizeof f / sizeof f[0];
-    if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof fprog) == -1)
-        perror("setsockopt");
-}
+    static bool spawn(std::vector<char *> &argv, pid_t &child)
+    {
+        sigset_t none;
+        sigemptyset(&none);
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, &none);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+        const int err = posix_spawnp(&child, argv[0], nullptr, &attr,
+                                     argv.data(), environ);
+        posix_spawnattr_destroy(&attr);
+        if(err)
+            std::cerr << "posix_spawnp " << argv[0] << ": " << strerror(err)
+                      << "\n";
+        return !err;
+    }
 
-bool cap_set_if_not(cap_t caps, cap_flag_value_t val, cap_value_t *list, size_t size)
+    // Makes sigtimedwait() in run() return to look at cmds again.
+    void wake()
+    {
+        pthread_kill(thread.native_handle(), SIGCHLD);
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> guard(mutex);
+        while(!quit || !cmds.empty()) {
+            const auto now = monotonic_ns();
+            uint64_t next = UINT64_MAX;
+            for(auto &c: cmds) {
+                if(c.stopped && c.deadline <= now)
+                    cont(c, "timeout");
+                if(c.stopped)
+                    next = std::min(next, c.deadline);
+            }
+            // drops the continued ones without a command
+            reap();
+            const struct timespec timeout = {
+                time_t((next - now) / 1000000000),
+                long((next - now) % 1000000000) };
+            guard.unlock();
+            siginfo_t info;
+            const int sig = sigtimedwait(&signals, &info,
+                                         next == UINT64_MAX ? nullptr
+                                                            : &timeout);
+            guard.lock();
+            if(sig > 0)
+                handle(info);
+        }
+    }
+
+    // Takes pending signals without waiting. mutex must be held.
+    void drain()
+    {
+        const struct timespec zero = {0, 0};
+        siginfo_t info;
+        while(sigtimedwait(&signals, &info, &zero) > 0)
+            handle(info);
+        reap();
+    }
+
+    void handle(const siginfo_t &info)
+    {
+        if(info.si_signo == SIGCHLD) {
+            reap();
+            return;
+        }
+        // from the command itself, or else one of its children: the oldest
+        // command still holding its target
+        const auto pid = info.si_pid;
+        auto it = std::find_if(cmds.begin(), cmds.end(), [pid](const cmd_t &c) {
+                return c.stopped && c.child == pid; });
+        if(it == cmds.end())
+            it = std::find_if(cmds.begin(), cmds.end(),
+                              [](const cmd_t &c) { return c.stopped; });
+        if(it != cmds.end())
+            cont(*it, "ready");
+    }
+
+    // SIGCHLD only says that some child changed state, and several of them
+    // are merged into one. waitpid() tells which commands really exited.
+    void reap()
+    {
+        for(auto c = cmds.begin(); c != cmds.end();) {
+            if(c->child == -1) {
+                c = c->stopped ? std::next(c) : cmds.erase(c);
+                continue;
+            }
+            int status;
+            const auto ret = waitpid(c->child, &status, WNOHANG);
+            if(ret == 0 || (ret == -1 && errno == EINTR)) {
+                ++c;
+                continue;
+            }
+            if(ret == -1)
+                perror("waitpid");
+            if(c->stopped)
+                cont(*c, "command exited");
+            c = cmds.erase(c);
+        }
+    }
+
+    void cont(cmd_t &c, const char *why)
+    {
+        if(kill(c.target, SIGCONT) == -1)
+            perror("kill SIGCONT");
+        std::cerr << "continued " << c.target << " after "
+                  << (monotonic_ns() - c.t0) / 1000000 << " ms (" << why
+                  << ")\n";
+        c.stopped = false;
+    }
+
+    const std::vector<std::string> cmd;
+    const int ready_ms;
+    sigset_t signals;
+    std::mutex mutex;
+    std::list<cmd_t> cmds;
+    bool quit;
+    std::thread thread;
+};
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+void print_ns(uint64_t ns)
 {
-    cap_flag_value_t flag;
-    if(cap_get_flag(caps, list[0], CAP_EFFECTIVE, &flag) == -1) {
-        perror("cap_get_flag");
-        return false;
+    printf("%llu.%09llu", (unsigned long long)(ns / 1000000000),
+           (unsigned long long)(ns % 1000000000));
+}
+
+// --wait-exit: holds a pidfd for each match and prints exec and exit with
+// CLOCK_MONOTONIC timestamps, lifetime and the gap since the previous
+// instance of the same name exited:
+// <t> exec <name> <pid> [gap <s>]
+// <t> exit <name> <pid> lifetime <s>
+class lifecycle_t {
+public:
+    explicit lifecycle_t(const std::vector<std::string> &specs)
+        : specs(specs), last_exit(specs.size(), 0)
+    {
     }
 
-    if(flag != val) {
-        if(cap_set_flag(caps, CAP_EFFECTIVE, size, list, val) == -1) {
-            perror("cap_set_flag");
-            return false;
+    ~lifecycle_t()
+    {
+        for(const auto &p: procs)
+            close(p.fd);
+    }
+
+    lifecycle_t(const lifecycle_t &) = delete;
+    lifecycle_t &operator=(const lifecycle_t &) = delete;
+
+    // exec_ns: event time from the kernel or 0 for now
+    void add(size_t idx, pid_t pid, uint64_t exec_ns)
+    {
+        if(!exec_ns)
+            exec_ns = monotonic_ns();
+        print_ns(exec_ns);
+        printf(" exec %s %d", specs[idx].c_str(), pid);
+        if(last_exit[idx] && exec_ns > last_exit[idx]) {
+            printf(" gap ");
+            print_ns(exec_ns - last_exit[idx]);
+        }
+        puts("");
+        fflush(stdout);
 
+        const int fd = syscall(SYS_pidfd_open, pid, 0);
+        if(fd == -1) {
+            if(errno != ESRCH) {
+                perror("pidfd_open");
+                return;
+            }
+            // already gone, report on the next wait
         }
-        if(cap_set_proc(caps) == -1) {
-            perror("cap_set_proc");
+        procs.push_back(proc_t{idx, pid, fd, exec_ns});
+    }
+
+    // Waits up to ms for an exit or for extra_fd to become readable.
+    // Calls on_exit(idx) for each exited process. Returns true if extra_fd
+    // is readable.
+    template<typename lambda_t>
+    bool wait(int extra_fd, int ms, lambda_t on_exit)
+    {
+        std::vector<pollfd> pfd;
+        for(const auto &p: procs)
+            pfd.push_back(pollfd{p.fd, POLLIN, 0});
+        if(extra_fd != -1)
+            pfd.push_back(pollfd{extra_fd, POLLIN, 0});
+        // a process gone before pidfd_open does not need to wait
+        const bool gone = std::any_of(procs.begin(), procs.end(),
+                                      [](const proc_t &p) { return p.fd == -1; });
+        const int mux = poll(pfd.data(), pfd.size(), gone ? 0 : ms);
+        if(mux == -1) {
+            if(errno != EINTR)
+                perror("poll");
             return false;
         }
+        const auto now = monotonic_ns();
+        size_t i = 0;
+        for(auto it = procs.begin(); it != procs.end(); i++) {
+            if(it->fd != -1 && !pfd[i].revents) {
+                ++it;
+                continue;
+            }
+            print_ns(now);
+            printf(" exit %s %d lifetime ", specs[it->idx].c_str(), it->pid);
+            print_ns(now - it->exec_ns);
+            puts("");
+            fflush(stdout);
+            if(it->fd != -1)
+                close(it->fd);
+            last_exit[it->idx] = now;
+            on_exit(it->idx);
+            it = procs.erase(it);
+        }
+        return extra_fd != -1 && pfd.back().revents;
     }
-    return true;
-}
 
-// Test if CAP_NET_ADMIN is effective, else make it effective
-bool get_priv()
-{
-    cap_value_t cap_list[1] = { CAP_NET_ADMIN };
-    if(!CAP_IS_SUPPORTED(CAP_NET_ADMIN)) {
-        std::cerr << "Capability CAP_NET_ADMIN is not supported\n";
-        return false;
+    bool empty() const { return procs.empty(); }
+
+private:
+    struct proc_t {
+        size_t idx;
+        pid_t pid;
+        int fd;
+        uint64_t exec_ns;
+    };
+
+    const std::vector<std::string> &specs;
+    std::vector<uint64_t> last_exit;
+    std::list<proc_t> procs;
+};
+
+// Prints matches and decides when to stop. With a single name only the pid
+// is printed and the first match ends the wait, like before. With several
+// names "<name> <pid>" is printed for each process that shows up. With
+// wait_all the wait ends once every name was seen.
+struct waiter_t {
+    waiter_t(const name_set_t &names, bool wait_all)
+        : names(names), found(names.size(), false), remaining(names.size()),
+          wait_all(wait_all)
+    {
     }
 
-    cap_t caps = cap_get_proc();
-    if(caps == NULL) {
-        perror("cap_get_proc");
-        return false;
+    bool single() const { return names.size() == 1; }
+
+    // Returns true when done. event_ns is the CLOCK_MONOTONIC time the
+    // kernel sent the event for pid, 0 when polling.
+    bool report(size_t idx, pid_t pid, const char *what, uint64_t event_ns)
+    {
+        if(!reported.insert(std::make_pair(idx, pid)).second)
+            return done();
+        if(stop) {
+            // freeze first, everything else can wait
+            const auto t0 = monotonic_ns();
+            if(kill(pid, SIGSTOP) == -1) {
+                perror("kill SIGSTOP");
+                return done();
+            }
+            const auto t1 = monotonic_ns();
+            std::cerr << "stopped " << pid << ": " << (t1 - t0) / 1000
+                      << " us after detection";
+            if(event_ns && t1 > event_ns)
+                std::cerr << ", " << (t1 - event_ns) / 1000
+                          << " us after the event";
+            std::cerr << "\n";
+        }
+        std::cerr << "match: " << what << "\n";
+        if(life)
+            life->add(idx, pid, event_ns);
+        else if(single())
+            std::cout << pid << "\n" << std::flush;
+        else
+            std::cout << names.specs[idx] << " " << pid << "\n" << std::flush;
+        if(!found[idx]) {
+            found[idx] = true;
+            remaining--;
+        }
+        if(attach)
+            attach->start(pid, stop);
+        return done();
+    }
+
+    bool done() const
+    {
+        return single() ? remaining == 0 : wait_all && remaining == 0;
     }
 
-    // Ensure that CAP_NET_ADMIN is permitted
-    bool ret = false;
-    cap_flag_value_t flag;
-    if(cap_get_flag(caps, cap_list[0], CAP_PERMITTED, &flag) == -1) {
-        perror("cap_get_flag");
-        goto out;
+    // Nothing left to wait for: all names seen and, with --wait-exit,
+    // their processes gone.
+    bool finished() const
+    {
+        return done() && (!life || life->empty());
+    }
+
+    // --follow-respawn: wait for name idx again after its process exited.
+    void rearm(size_t idx)
+    {
+        if(found[idx]) {
+            found[idx] = false;
+            remaining++;
+        }
     }
-    if(flag != CAP_SET) {
-        std::cerr << "Capability CAP_NET_ADMIN is not CAP_PERMITTED, run setcap CAP_NET_ADMIN=p <binary>\n";
-        goto out;
+
+    // Match base (argv[0] basename or comm) of pid against all names.
+    bool check(const char *base, pid_t pid, const char *what,
+               uint64_t event_ns = 0)
+    {
+        names.match(base, [this, pid, what, event_ns](size_t idx) {
+                report(idx, pid, what, event_ns); });
+        return done();
     }
 
-    ret = cap_set_if_not(caps, CAP_SET, cap_list, 1);
-    assert(ret || (cap_get_flag(caps, cap_list[0], CAP_EFFECTIVE, &flag) == 0
-                   && flag == CAP_SET));
+    const name_set_t &names;
+    std::vector<bool> found;
+    size_t remaining;
+    bool wait_all;
+    std::set<std::pair<size_t, pid_t>> reported;
+    // --stop, --exec and --ready-delay
+    bool stop {false};
+    attacher_t *attach {nullptr};
+    lifecycle_t *life {nullptr};
+};
 
-out:
-    cap_free(caps);
-    return ret;
+bool check_pid(proc_scanner_t &proc, waiter_t &waiter, pid_t pid,
+               uint64_t event_ns = 0)
+{
+    const char *cmdline = proc.read(pid, "cmdline");
+    if(!cmdline)
+        return false;
+    const char * base = get_basename(cmdline);
+    return waiter.check(base, pid, cmdline, event_ns);
 }
 
-// Drop CAP_NET_ADMIN to permitted if effective
-bool drop_priv()
+#ifdef USE_PROC_CONN
+bool proc_iterate(proc_scanner_t &proc, waiter_t &waiter)
 {
-    cap_value_t cap_list[1] = { CAP_NET_ADMIN };
-    auto caps = cap_get_proc();
-    if(caps == NULL) {
-        perror("cap_get_proc");
+    return proc.foreach_pid([&proc, &waiter](pid_t pid) {
+            return check_pid(proc, waiter, pid); });
+}
+#endif
+
+// Polling without the proc connector. Remembers the pids already checked
+// with their start time, so a pass only reads cmdline of new processes.
+// A pid is checked again while it is young, to see an exec shortly after
+// the fork, and every pid once per FULL, for late execs. The interval drops
+// to MIN when new processes show up and doubles up to MAX when idle.
+class proc_poller_t {
+public:
+    typedef std::chrono::steady_clock clock_t;
+
+    static constexpr std::chrono::milliseconds MIN{10};
+    static constexpr std::chrono::milliseconds MAX{250};
+    static constexpr std::chrono::milliseconds YOUNG{1000};
+    static constexpr std::chrono::milliseconds FULL{1000};
+
+    proc_poller_t(proc_scanner_t &proc, waiter_t &waiter)
+        : interval(MIN), proc(proc), waiter(waiter), gen(0),
+          next_full(clock_t::now() + FULL)
+    {
+    }
+
+    // Returns true when done.
+    bool pass()
+    {
+        return pass(proc);
+    }
+
+    // Same for the pids of source.foreach_pid_ino() instead of all of /proc.
+    template<typename source_t>
+    bool pass(source_t &source)
+    {
+        const auto now = clock_t::now();
+        const bool full = now >= next_full;
+        size_t fresh = 0;
+        gen++;
+        const auto done = source.foreach_pid_ino(
+            [this, now, full, &fresh](pid_t pid, ino64_t ino) {
+                auto it = pids.find(pid);
+                if(it == pids.end()) {
+                    it = pids.emplace(pid, entry_t{ino, proc.starttime(pid),
+                                                   now, gen}).first;
+                    fresh++;
+                } else if(it->second.ino != ino) {
+                    const auto start = proc.starttime(pid);
+                    if(start != it->second.start) {
+                        // pid reused
+                        it->second.start = start;
+                        it->second.seen = now;
+                        fresh++;
+                    }
+                    it->second.ino = ino;
+                }
+                it->second.gen = gen;
+                if(!full && now - it->second.seen >= YOUNG)
+                    return false;
+                return check_pid(proc, waiter, pid); });
+        if(done)
+            return true;
+
+        for(auto it = pids.begin(); it != pids.end();)
+            it = it->second.gen != gen ? pids.erase(it) : std::next(it);
+        if(full)
+            next_full = now + FULL;
+        // everything is new in the first pass
+        if(fresh && gen > 1)
+            interval = MIN;
+        else
+            interval = std::min(interval * 2, MAX);
         return false;
     }
 
-    const auto ret = cap_set_if_not(caps, CAP_CLEAR, cap_list, 1);
+    // processes seen in the last complete pass
+    size_t size() const { return pids.size(); }
 
-#ifndef NDEBUG
-    cap_flag_value_t flag;
-    assert(!ret || (cap_get_flag(caps, cap_list[0], CAP_PERMITTED, &flag) == 0
-                    && flag == CAP_SET
-                    && cap_get_flag(caps, cap_list[0], CAP_EFFECTIVE, &flag) == 0
-                    && flag == CAP_CLEAR));
-#endif
+    std::chrono::milliseconds interval;
 
-    cap_free(caps);
-    return ret;
-}
+private:
+    struct entry_t {
+        ino64_t ino;
+        unsigned long long start;
+        clock_t::time_point seen;
+        unsigned gen;
+    };
+
+    proc_scanner_t &proc;
+    waiter_t &waiter;
+    std::unordered_map<pid_t, entry_t> pids;
+    unsigned gen;
+    clock_t::time_point next_full;
+};
 
-struct fork_handler_t {
-    fork_handler_t()
-        : fd(-1), total(0), ok(0)
+constexpr std::chrono::milliseconds proc_poller_t::MIN;
+constexpr std::chrono::milliseconds proc_poller_t::MAX;
+constexpr std::chrono::milliseconds proc_poller_t::YOUNG;
+constexpr std::chrono::milliseconds proc_poller_t::FULL;
+
+// --cgroup: the pids in a cgroup v2 directory and its descendants, for
+// proc_poller_t::pass(). Moving a process into the cgroup writes
+// cgroup.procs and the first process in an empty subtree changes
+// cgroup.events, both wake up wait() through inotify. Forks and execs
+// inside the cgroup do not, so while it is populated the caller still has
+// to poll, but only this cgroup's processes.
+class cgroup_t {
+public:
+    cgroup_t(proc_scanner_t &proc, const std::string &path)
+        : fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), proc(proc),
+          dir(open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)), buf(4096)
     {
-        if(!get_priv())
-            return;
-        fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
-                    NETLINK_CONNECTOR);
-        if(fd == -1) {
-            perror("socket");
+        if(dir == -1) {
+            perror(path.c_str());
             return;
         }
-
-        addr.nl_family = AF_NETLINK;
-        addr.nl_pid = getpid();
-        addr.nl_groups = CN_IDX_PROC;
-
-        auto err = bind(fd, (struct sockaddr *)&addr, sizeof addr);
-        if(err == -1) {
-            perror("bind");
-            close(fd);
-            fd = -1;
+        if(fd == -1) {
+            perror("inotify_init1");
             return;
         }
-
-        filter(fd);
-
-        { // send subscription message
-            char nlmsghdrbuf[NLMSG_LENGTH(0)];
-            nlmsghdr *nlmsghdr = reinterpret_cast<struct nlmsghdr *>(nlmsghdrbuf);
-
-            nlmsghdr->nlmsg_len = NLMSG_LENGTH(sizeof(cn_msg) + sizeof(proc_cn_mcast_op));
-            nlmsghdr->nlmsg_type = NLMSG_DONE;
-            nlmsghdr->nlmsg_flags = 0;
-            nlmsghdr->nlmsg_seq = 0;
-            nlmsghdr->nlmsg_pid = getpid();
-
-            struct cn_msg cn_msg;
-            enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
-            cn_msg.id.idx = CN_IDX_PROC;
-            cn_msg.id.val = CN_VAL_PROC;
-            cn_msg.seq = 0;
-            cn_msg.ack = 0;
-            cn_msg.len = sizeof op;
-
-            struct iovec iov[3];
-            iov[0].iov_base = nlmsghdrbuf;
-            iov[0].iov_len = NLMSG_LENGTH(0);
-            iov[1].iov_base = &cn_msg;
-            iov[1].iov_len = sizeof cn_msg;
-            iov[2].iov_base = &op;
-            iov[2].iov_len = sizeof op;
-
-            // TODO: loop if EINTR, poll to handle EAGAIN
-            const auto tx = writev(fd, iov, 3);
-            if(tx == -1) {
-                perror("writev");
+        for(const char *f: {"/cgroup.procs", "/cgroup.events"})
+            if(inotify_add_watch(fd, (path + f).c_str(), IN_MODIFY) == -1) {
+                perror((path + f).c_str());
                 close(fd);
                 fd = -1;
                 return;
             }
-            // TODO: writev for datagram socket means all iovs or none?
-            assert(size_t(tx) == (iov[0].iov_len + iov[1].iov_len + iov[2].iov_len));
-            std::cerr << "subscription ok\n";
-        }
-        // If capabilites are dropped before sending the subscription
-        // message leads to strange behavior: no messages will be
-        // received until subscription message is sent once with
-        // uid=0.
-        drop_priv();
-        buf.resize(getpagesize());
     }
 
-    ~fork_handler_t()
+    ~cgroup_t()
     {
+        if(dir != -1)
+            close(dir);
         if(fd != -1)
             close(fd);
     }
 
-    bool is_ok() const { return fd != -1; }
+    cgroup_t(const cgroup_t &) = delete;
+    cgroup_t &operator=(const cgroup_t &) = delete;
 
-    bool wait_for(size_t ms_timeout)
+    bool is_ok() const { return dir != -1 && fd != -1; }
+
+    // cb(pid, ino) like proc_scanner_t::foreach_pid_ino.
+    template<typename lambda_t>
+    bool foreach_pid_ino(lambda_t cb)
     {
-        pollfd pfd[1];
-        pfd[0].events = POLLIN;
-        pfd[0].fd = fd;
-        const auto mux = poll(pfd, 1, ms_timeout);
-        if(mux == 0) {
-            return false;
-        } else if(mux == -1) {
-            perror("poll");
-            close(fd);
-            fd = -1;
-            return false;
-        }
-        assert(mux == 1);
-        return true;
+        return foreach_pid_ino(dir, cb, 0);
+    }
+
+    // Drains pending inotify events. Returns true if there were any.
+    bool drain()
+    {
+        bool any = false;
+        while(::read(fd, buf.data(), buf.size()) > 0)
+            any = true;
+        return any;
     }
 
+    int fd;
+
+private:
     template<typename lambda_t>
-    void try_rx(lambda_t cb)
-    {
-        struct msghdr msghdr;
-        struct iovec iov[1];
-
-        msghdr.msg_name = &addr;
-        msghdr.msg_namelen = sizeof(addr);
-        msghdr.msg_iov = iov;
-        msghdr.msg_iovlen = 1;
-        msghdr.msg_control = NULL;
-        msghdr.msg_controllen = 0;
-        msghdr.msg_flags = 0;
-
-        iov[0].iov_base = buf.data();
-        iov[0].iov_len = buf.size();
-
-        // read: | nlmsghdr | cn_msg | proc_event ... |
-        auto len = recvmsg(fd, &msghdr, 0);
-        if(len == -1) {
-            perror("recvmsg");
-            return;
+    bool foreach_pid_ino(int d, lambda_t &cb, int depth)
+    {
+        const int f = openat(d, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+        if(f != -1) {
+            std::string pids;
+            ssize_t len;
+            while((len = ::read(f, buf.data(), buf.size())) > 0)
+                pids.append(buf.data(), len);
+            close(f);
+            char name[16];
+            struct stat st;
+            for(const char *c = pids.c_str(); *c;) {
+                char *end;
+                const pid_t pid = strtol(c, &end, 10);
+                if(end == c)
+                    break;
+                c = *end ? end + 1 : end;
+                snprintf(name, sizeof name, "%d", pid);
+                // same inode as the getdents entry of /proc
+                if(fstatat(proc.fd, name, &st, 0) == -1)
+                    continue;
+                if(cb(pid, st.st_ino))
+                    return true;
+            }
         }
+        if(depth == 16)
+            return false;
 
-        //std::cout << "have " << len << " bytes. pid=" << addr.nl_pid << "\n";
-        // from kernel?
-        if(addr.nl_pid != 0)
-            return;
-        for(nlmsghdr *nlhdr = (nlmsghdr *)buf.data(); NLMSG_OK(nlhdr, len);
-            nlhdr = NLMSG_NEXT(nlhdr, len)) {
-            total++;
-            if((nlhdr->nlmsg_type == NLMSG_ERROR)
-               || (nlhdr->nlmsg_type == NLMSG_NOOP)) {
-                // filter out?
-                assert(false);
+        // child cgroups
+        const int dup_d = openat(d, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *dp = dup_d == -1 ? nullptr : fdopendir(dup_d);
+        if(!dp) {
+            if(dup_d != -1)
+                close(dup_d);
+            return false;
+        }
+        bool ret = false;
+        while(const auto e = readdir(dp)) {
+            if(e->d_type != DT_DIR || e->d_name[0] == '.')
                 continue;
-            }
-            struct cn_msg *cn_msg = (struct cn_msg *)NLMSG_DATA(nlhdr);
-            assert((cn_msg->id.idx == CN_IDX_PROC)
-                   && (cn_msg->id.val == CN_VAL_PROC));
-            ok++;
-            std::cerr << "ok/total: " << ok << "/" << total << "\n";
-
-            proc_event *ev = (struct proc_event *)cn_msg->data;
-            switch(ev->what) {
-            case proc_event::PROC_EVENT_EXEC:
-                // if pid != tgid -> new thread, else new process -> should be filtered out
-                std::cerr << "EXEC pid: " << ev->event_data.exec.process_pid
-                          << " tgid:" << ev->event_data.exec.process_tgid << "\n";
-                cb(ev->event_data.exec.process_pid, ev->event_data.exec.process_tgid);
-                break;
-            default:
-                std::cerr << "OTHER " << ev->event_data.fork.parent_pid
-                          << "/" << ev->event_data.fork.parent_tgid << "\n";
-                // shouldnt occur with filter active
-                assert(false);
+            const int sub = openat(d, e->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if(sub == -1)
+                continue;
+            ret = foreach_pid_ino(sub, cb, depth + 1);
+            close(sub);
+            if(ret)
                 break;
-            }
         }
+        closedir(dp);
+        return ret;
     }
 
-    int fd;
-    size_t total;
-    size_t ok;
-    struct sockaddr_nl addr;
+    proc_scanner_t &proc;
+    int dir;
     std::vector<char> buf;
 };
 
+std::atomic_bool sigint;
+void sighandler(int)
+{
+    sigint = true;
 }
 
-#endif
+// Used without XDG_RUNTIME_DIR. The daemon creates it with mode 0700.
+std::string fallback_socket_dir()
+{
+    return "/tmp/spidof-" + std::to_string(geteuid());
+}
 
-namespace {
-const char *get_basename(const char *filename)
+std::string default_socket_path()
 {
-    const char *result = filename;
-    while(*filename != '\0')
-        if(*(filename++) == '/')
-            result = filename;
-    return result;
+    const char *dir = std::getenv("XDG_RUNTIME_DIR");
+    return (dir ? std::string(dir) : fallback_socket_dir()) + "/spidof.sock";
 }
 
-static bool check_pid(const std::string &name, pid_t pid)
+// The other end of a unix socket has to be the same user or root.
+bool trusted_peer(int fd)
 {
-//    std::cout << name << "/" << pid << "\n";
-    std::string buff(512, '\0');
-    {
-        char path[256];
-        std::snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
-        std::ifstream fp(path);
-        buff.resize(fp.read(&*buff.begin(), buff.length()).gcount());
+    ucred cred;
+    socklen_t len = sizeof cred;
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        perror("SO_PEERCRED");
+        return false;
     }
-    const char * base = get_basename(buff.c_str());
+    return cred.uid == geteuid() || cred.uid == 0;
+}
 
-    // oneshot
-    if(std::strncmp(name.c_str(), base, name.length()) == 0) {
-        std::cerr << "match: " << buff << "\n";
-        std::cout << pid << "\n" << std::flush;
-        return true;
+int unix_socket(const std::string &path, sockaddr_un &addr)
+{
+    if(path.length() >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.length());
+    return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+// Ask a running daemon to wait for name. Returns false if no daemon is
+// listening on path, so the caller can do the work itself.
+bool daemon_wait(const std::string &path, const std::string &name,
+                 size_t ms_timeout)
+{
+    sockaddr_un addr;
+    const int fd = unix_socket(path, addr);
+    if(fd == -1)
+        return false;
+    if(connect(fd, (struct sockaddr *)&addr, sizeof addr) == -1) {
+        close(fd);
+        return false;
+    }
+    if(!trusted_peer(fd)) {
+        std::cerr << path << ": daemon runs as another user, ignoring it\n";
+        close(fd);
+        return false;
     }
 
-    std::cerr << "mismatch: " << buff << "\n";
-    return false;
+    const auto req = "wait " + name + " " + std::to_string(ms_timeout) + "\n";
+    if(write(fd, req.data(), req.length()) != ssize_t(req.length())) {
+        close(fd);
+        return false;
+    }
+    // the daemon may hold the request for ms_timeout, ^C must still work
+    std::string reply;
+    char buf[256];
+    while(!sigint) {
+        pollfd pfd = { fd, POLLIN, 0 };
+        const int mux = poll(&pfd, 1, 100);
+        if(mux == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if(mux <= 0)
+            continue;
+        const auto len = ::read(fd, buf, sizeof buf);
+        if(len == -1 && errno == EINTR)
+            continue;
+        if(len <= 0)
+            break;
+        reply.append(buf, len);
+    }
+    close(fd);
+    if(sigint)
+        return true;
+    if(reply.empty() || reply.back() != '\n')
+        return false;
+    std::cerr << "daemon: " << path << "\n";
+    // "\n" on timeout: nothing on stdout, like without the daemon
+    if(reply == "\n")
+        return true;
+    char *end;
+    const auto pid = strtoul(reply.c_str(), &end, 10);
+    if(!isdigit((unsigned char)reply[0]) || end != &reply.back()) {
+        std::cerr << "daemon: unexpected reply " << reply;
+        return false;
+    }
+    std::cout << pid << "\n" << std::flush;
+    return true;
 }
 
-bool proc_iterate(const std::string &name)
+#ifdef USE_PROC_CONN
+// fork_handler_t does not print why it could not subscribe
+static void proc_conn_error(const fork_handler_t &notify)
 {
-    bool have = false;
-    auto const path_handler = [&name, &have](const std::experimental::filesystem::path &path) {
-        const auto pid = std::atoi(path.filename().c_str());
-        if(pid == 0)
-            return true;
-        if(check_pid(name, pid)) {
-            have = true;
-            return false;
+    std::cerr << "proc connector: " << strerror(notify.init_error) << "\n";
+    if(notify.init_error == EPERM)
+        std::cerr << "CAP_NET_ADMIN is not permitted, run setcap "
+                     "CAP_NET_ADMIN=p <binary>\n";
+}
+
+// Process table kept current from FORK/EXEC/COMM/EXIT events.
+class daemon_t {
+public:
+    daemon_t(const std::string &path, int rcvbuf)
+        : path(path), listen_fd(-1),
+          notify({proc_event::PROC_EVENT_FORK, proc_event::PROC_EVENT_EXEC,
+                  proc_event::PROC_EVENT_COMM, proc_event::PROC_EVENT_EXIT},
+                 {}, rcvbuf)
+    {
+        if(!notify.is_ok()) {
+            proc_conn_error(notify);
+            return;
         }
-        return false;
+        if(path == fallback_socket_dir() + "/spidof.sock"
+           && !private_dir(fallback_socket_dir()))
+            return;
+        sockaddr_un addr;
+        listen_fd = unix_socket(path, addr);
+        if(listen_fd == -1) {
+            perror("socket");
+            return;
+        }
+        if(!remove_stale(addr)) {
+            close(listen_fd);
+            listen_fd = -1;
+            return;
+        }
+        if(bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) == -1
+           || listen(listen_fd, 64) == -1) {
+            perror("bind/listen");
+            close(listen_fd);
+            listen_fd = -1;
+            return;
+        }
+        rescan();
+    }
+
+    ~daemon_t()
+    {
+        for(const auto &w: waiters)
+            close(w.fd);
+        for(const auto &c: clients)
+            close(c.fd);
+        if(listen_fd != -1) {
+            close(listen_fd);
+            unlink(path.c_str());
+        }
+    }
+
+    bool is_ok() const { return listen_fd != -1 && notify.is_ok(); }
+
+    void run()
+    {
+        while(!sigint && notify.is_ok()) {
+            std::vector<pollfd> pfd(2);
+            pfd[0].fd = notify.fd;
+            pfd[0].events = POLLIN;
+            pfd[1].fd = listen_fd;
+            pfd[1].events = POLLIN;
+            for(const auto &c: clients)
+                pfd.push_back(pollfd {c.fd, POLLIN, 0});
+            const auto mux = poll(pfd.data(), pfd.size(), next_timeout());
+            if(mux == -1 && errno != EINTR) {
+                perror("poll");
+                return;
+            }
+            if(mux > 0 && (pfd[0].revents & POLLIN))
+                receive();
+            // same order as in pfd, before accept_client() adds to clients
+            auto c = clients.begin();
+            for(size_t i = 2; mux > 0 && i < pfd.size(); i++)
+                c = pfd[i].revents ? read_client(c) : std::next(c);
+            if(mux > 0 && (pfd[1].revents & POLLIN))
+                accept_client();
+            expire_waiters();
+        }
+    }
+
+private:
+    struct entry_t {
+        pid_t tgid;
+        char comm[16];
+        std::string exe;
+        // basename of argv[0], compared like check_pid() does
+        std::string name;
+        uint64_t cmdline_hash;
     };
 
-    for(auto &it: std::experimental::filesystem::directory_iterator("/proc")) {
-        std::error_code ec;
-        if(!std::experimental::filesystem::is_directory(it, ec))
-            continue;
-        path_handler(it.path());
-        if(have)
+    struct waiter_t {
+        int fd;
+        std::string name;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    // A connection whose request line is not complete yet.
+    struct client_t {
+        int fd;
+        std::string request;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    // Clients get this long to send their request.
+    static constexpr std::chrono::milliseconds CLIENT_TIMEOUT {1000};
+    static constexpr size_t MAX_REQUEST = 512;
+    // Longer waits are cut, a client must not hold a waiter forever.
+    static constexpr std::chrono::milliseconds MAX_WAIT {600000};
+
+    // Creates dir if needed. Fails if it is not a directory owned by us, or if
+    // others have access to it: anybody else could replace the socket then.
+    static bool private_dir(const std::string &dir)
+    {
+        if(mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+            perror(("mkdir " + dir).c_str());
+            return false;
+        }
+        struct stat s;
+        if(lstat(dir.c_str(), &s) == -1) {
+            perror(("lstat " + dir).c_str());
+            return false;
+        }
+        if(!S_ISDIR(s.st_mode) || s.st_uid != geteuid() || (s.st_mode & 077)) {
+            std::cerr << dir << ": not a private directory of this user\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Unlinks a socket nobody listens on anymore. Fails if a daemon answers
+    // on it or if it is something else.
+    static bool remove_stale(const sockaddr_un &addr)
+    {
+        struct stat s;
+        if(lstat(addr.sun_path, &s) == -1)
+            return errno == ENOENT;
+        if(!S_ISSOCK(s.st_mode)) {
+            std::cerr << addr.sun_path << ": exists and is no socket\n";
+            return false;
+        }
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd == -1) {
+            perror("socket");
+            return false;
+        }
+        const bool live = connect(fd, (const struct sockaddr *)&addr,
+                                  sizeof addr) == 0;
+        close(fd);
+        if(live) {
+            std::cerr << addr.sun_path << ": a daemon is running already\n";
+            return false;
+        }
+        if(unlink(addr.sun_path) == -1) {
+            perror(("unlink " + std::string(addr.sun_path)).c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static uint64_t fnv1a(const char *data, size_t len)
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for(size_t i = 0; i < len; i++)
+            h = (h ^ (unsigned char)data[i]) * 0x100000001b3ull;
+        return h;
+    }
+
+    static bool name_matches(const std::string &name, const std::string &base)
+    {
+        return base.compare(0, name.length(), name) == 0;
+    }
+
+    void receive()
+    {
+        if(!notify.try_rx([this](const proc_event &ev) { on_event(ev); })) {
+            std::cerr << "netlink overflow (" << notify.dropped()
+                      << " messages dropped so far), rescanning /proc\n";
+            rescan();
+        }
+    }
+
+    void on_event(const proc_event &ev)
+    {
+        switch(ev.what) {
+        case proc_event::PROC_EVENT_FORK: {
+            const auto &f = ev.event_data.fork;
+            const auto parent = table.find(f.parent_tgid);
+            if(parent == table.end()) {
+                update(f.child_pid, f.child_tgid);
+                break;
+            }
+            auto entry = parent->second;
+            entry.tgid = f.child_tgid;
+            insert(f.child_pid, std::move(entry));
+            break;
+        }
+        case proc_event::PROC_EVENT_EXEC: {
+            const auto &e = ev.event_data.exec;
+            update(e.process_pid, e.process_tgid);
+            if(e.process_pid == e.process_tgid)
+                notify_waiters(e.process_pid);
+            break;
+        }
+        case proc_event::PROC_EVENT_COMM: {
+            const auto &c = ev.event_data.comm;
+            const auto it = table.find(c.process_pid);
+            if(it != table.end())
+                memcpy(it->second.comm, c.comm, sizeof it->second.comm);
+            break;
+        }
+        case proc_event::PROC_EVENT_EXIT:
+            erase(ev.event_data.exit.process_pid);
             break;
+        default:
+            break;
+        }
+    }
+
+    // (Re)read an entry from /proc.
+    void update(pid_t pid, pid_t tgid)
+    {
+        entry_t entry;
+        entry.tgid = tgid;
+        size_t len = 0;
+        const char *cmdline = proc.read(pid, "cmdline", &len);
+        if(!cmdline) {
+            erase(pid);
+            return;
+        }
+        entry.cmdline_hash = fnv1a(cmdline, len);
+        entry.name = get_basename(cmdline);
+        const char *comm = proc.read(pid, "comm", &len);
+        memset(entry.comm, 0, sizeof entry.comm);
+        if(comm)
+            memcpy(entry.comm, comm, std::min(len ? len - 1 : 0, sizeof entry.comm - 1));
+        const char *exe = proc.readlink(pid, "exe");
+        if(exe)
+            entry.exe = exe;
+        insert(pid, std::move(entry));
+    }
+
+    void insert(pid_t pid, entry_t &&entry)
+    {
+        erase(pid);
+        if(pid == entry.tgid)
+            by_name.emplace(entry.name, pid);
+        table[pid] = std::move(entry);
+    }
+
+    void erase(pid_t pid)
+    {
+        const auto it = table.find(pid);
+        if(it == table.end())
+            return;
+        if(pid == it->second.tgid) {
+            const auto range = by_name.equal_range(it->second.name);
+            for(auto n = range.first; n != range.second; ++n) {
+                if(n->second == pid) {
+                    by_name.erase(n);
+                    break;
+                }
+            }
+        }
+        table.erase(it);
+    }
+
+    void rescan()
+    {
+        table.clear();
+        by_name.clear();
+        std::vector<pid_t> pids;
+        proc.foreach_pid([&pids](pid_t pid) {
+                pids.push_back(pid);
+                return false; });
+        std::vector<pid_t> tids;
+        for(const auto pid: pids) {
+            update(pid, pid);
+            tids.clear();
+            proc.foreach_tid(pid, [&tids](pid_t tid) {
+                    tids.push_back(tid);
+                    return false; });
+            const auto leader = table.find(pid);
+            for(const auto tid: tids) {
+                if(tid == pid || leader == table.end())
+                    continue;
+                auto entry = leader->second;
+                const char *comm = proc.read(tid, "comm");
+                if(comm)
+                    strncpy(entry.comm, comm, sizeof entry.comm - 1);
+                entry.comm[strcspn(entry.comm, "\n")] = '\0';
+                table[tid] = std::move(entry);
+            }
+        }
+        std::cerr << "table: " << table.size() << " tasks\n";
+        // notify_waiters() erases from waiters, collect the pids first
+        pids.clear();
+        for(const auto &w: waiters)
+            for(const auto pid: lookup(w.name))
+                pids.push_back(pid);
+        for(const auto pid: pids)
+            notify_waiters(pid);
+    }
+
+    // Processes whose argv[0] basename starts with name.
+    std::vector<pid_t> lookup(const std::string &name) const
+    {
+        std::vector<pid_t> ret;
+        for(auto it = by_name.lower_bound(name);
+            it != by_name.end() && name_matches(name, it->first); ++it)
+            ret.push_back(it->second);
+        return ret;
+    }
+
+    static void reply(int fd, const std::string &msg)
+    {
+        // the client may be gone already
+        if(send(fd, msg.data(), msg.length(), MSG_NOSIGNAL) == -1)
+            perror("send");
+        close(fd);
+    }
+
+    void notify_waiters(pid_t pid)
+    {
+        const auto it = table.find(pid);
+        if(it == table.end())
+            return;
+        for(auto w = waiters.begin(); w != waiters.end();) {
+            if(name_matches(w->name, it->second.name)) {
+                reply(w->fd, std::to_string(pid) + "\n");
+                w = waiters.erase(w);
+            } else {
+                ++w;
+            }
+        }
+    }
+
+    int next_timeout() const
+    {
+        int ms = 1000;
+        const auto now = std::chrono::steady_clock::now();
+        for(const auto &w: waiters) {
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                w.deadline - now).count();
+            ms = std::max(0, std::min<int>(ms, left));
+        }
+        for(const auto &c: clients) {
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                c.deadline - now).count();
+            ms = std::max(0, std::min<int>(ms, left));
+        }
+        return ms;
+    }
+
+    void expire_waiters()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        for(auto w = waiters.begin(); w != waiters.end();) {
+            if(w->deadline <= now) {
+                reply(w->fd, "\n");
+                w = waiters.erase(w);
+            } else {
+                ++w;
+            }
+        }
+        for(auto c = clients.begin(); c != clients.end();) {
+            if(c->deadline <= now) {
+                close(c->fd);
+                c = clients.erase(c);
+            } else {
+                ++c;
+            }
+        }
+    }
+
+    // Client sockets are nonblocking and read from the poll loop, so a slow
+    // client does not hold up events or other clients.
+    void accept_client()
+    {
+        const int fd = accept4(listen_fd, nullptr, nullptr,
+                               SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if(fd == -1) {
+            perror("accept4");
+            return;
+        }
+        if(!trusted_peer(fd)) {
+            close(fd);
+            return;
+        }
+        clients.push_back(client_t {
+            fd, std::string(), std::chrono::steady_clock::now() + CLIENT_TIMEOUT});
+    }
+
+    // Reads what is there and handles the request once it is complete.
+    // Returns the next client.
+    std::list<client_t>::iterator read_client(std::list<client_t>::iterator c)
+    {
+        char buf[MAX_REQUEST];
+        const auto len = ::read(c->fd, buf, sizeof buf);
+        if(len == -1 && (errno == EAGAIN || errno == EINTR))
+            return std::next(c);
+        if(len > 0)
+            c->request.append(buf, len);
+        if(len > 0 && c->request.find('\n') == std::string::npos
+           && c->request.length() < MAX_REQUEST)
+            return std::next(c);
+        if(len <= 0 && c->request.empty())
+            close(c->fd);
+        else
+            handle(c->fd, c->request.substr(0, MAX_REQUEST - 1));
+        return clients.erase(c);
+    }
+
+    void handle(int fd, const std::string &buf)
+    {
+        char cmd[16];
+        char name[256];
+        unsigned long ms = 0;
+        const auto n = sscanf(buf.c_str(), "%15s %255s %lu", cmd, name, &ms);
+        if(n >= 2 && strcmp(cmd, "lookup") == 0) {
+            std::string msg;
+            for(const auto pid: lookup(name))
+                msg += (msg.empty() ? "" : " ") + std::to_string(pid);
+            reply(fd, msg + "\n");
+        } else if(n == 3 && strcmp(cmd, "wait") == 0) {
+            const auto pids = lookup(name);
+            if(!pids.empty()) {
+                reply(fd, std::to_string(pids.front()) + "\n");
+                return;
+            }
+            waiters.push_back(waiter_t {
+                fd, name, std::chrono::steady_clock::now()
+                    + std::chrono::milliseconds(
+                        std::min<unsigned long>(ms, MAX_WAIT.count()))});
+        } else {
+            reply(fd, "error\n");
+        }
     }
-    return have;
+
+    std::string path;
+    int listen_fd;
+    fork_handler_t notify;
+    proc_scanner_t proc;
+    std::unordered_map<pid_t, entry_t> table;
+    std::multimap<std::string, pid_t> by_name;
+    std::list<waiter_t> waiters;
+    std::list<client_t> clients;
+};
+
+constexpr std::chrono::milliseconds daemon_t::CLIENT_TIMEOUT;
+constexpr std::chrono::milliseconds daemon_t::MAX_WAIT;
+#endif
+
+struct opt_t {
+    std::vector<std::string> names;
+    // --file
+    std::vector<std::string> files;
+    bool wait_all {false};
+    bool stop {false};
+    // --exec, everything after it
+    std::vector<std::string> exec;
+    int ready_ms {500};
+    bool wait_exit {false};
+    bool follow_respawn {false};
+    // skip the proc connector, poll /proc
+    bool poll {false};
+    // proc connector without exec events
+    bool comm_only {false};
+    // watch only this cgroup, no proc connector
+    std::string cgroup;
+    bool daemon {false};
+    std::string socket {default_socket_path()};
+    // netlink receive buffer, 0 keeps the system default
+    int rcvbuf {4 << 20};
+};
+
+void usage(const char *arg0)
+{
+    std::cerr << "Usage: " << arg0 << " [--socket <path>] [--rcvbuf <bytes>]"
+                 " [--all] [--file <names>] [--stop] [--ready-delay <ms>]"
+                 " [--wait-exit] [--follow-respawn] [--cgroup <path>]"
+                 " [--poll|--comm-only]"
+                 " <name>... [--exec <cmd> [<arg>|{}]...]\n"
+              << "       " << arg0 << " --daemon [--socket <path>] [--rcvbuf <bytes>]\n"
+              << "name: <prefix>|exact:<name>|glob:<pattern>|regex:<ere>\n";
 }
 
-std::atomic_bool sigint;
-void sighandler(int)
+std::pair<bool, opt_t> parse_args(int argc, char *argv[])
 {
-    sigint = true;
+    opt_t ret;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--daemon") == 0) {
+            ret.daemon = true;
+        } else if(strcmp(argv[i], "--socket") == 0) {
+            ++i;
+            if(i >= argc)
+                return std::make_pair(false, ret);
+            ret.socket.assign(argv[i]);
+        } else if(strcmp(argv[i], "--rcvbuf") == 0) {
+            ++i;
+            if(i >= argc)
+                return std::make_pair(false, ret);
+            ret.rcvbuf = std::atoi(argv[i]);
+        } else if(strcmp(argv[i], "--file") == 0) {
+            ++i;
+            if(i >= argc)
+                return std::make_pair(false, ret);
+            ret.files.push_back(argv[i]);
+        } else if(strcmp(argv[i], "--all") == 0) {
+            ret.wait_all = true;
+        } else if(strcmp(argv[i], "--stop") == 0) {
+            ret.stop = true;
+        } else if(strcmp(argv[i], "--cgroup") == 0) {
+            ++i;
+            if(i >= argc)
+                return std::make_pair(false, ret);
+            ret.cgroup.assign(argv[i]);
+        } else if(strcmp(argv[i], "--poll") == 0) {
+            ret.poll = true;
+        } else if(strcmp(argv[i], "--comm-only") == 0) {
+            ret.comm_only = true;
+        } else if(strcmp(argv[i], "--wait-exit") == 0) {
+            ret.wait_exit = true;
+        } else if(strcmp(argv[i], "--follow-respawn") == 0) {
+            ret.wait_exit = true;
+            ret.follow_respawn = true;
+        } else if(strcmp(argv[i], "--ready-delay") == 0) {
+            ++i;
+            if(i >= argc)
+                return std::make_pair(false, ret);
+            ret.ready_ms = std::atoi(argv[i]);
+        } else if(strcmp(argv[i], "--exec") == 0) {
+            ret.exec.assign(argv + i + 1, argv + argc);
+            if(ret.exec.empty())
+                return std::make_pair(false, ret);
+            break;
+        } else {
+            ret.names.push_back(argv[i]);
+        }
+    }
+    const bool have_names = !ret.names.empty() || !ret.files.empty();
+    return std::make_pair(ret.daemon != have_names, ret);
 }
 }
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2)
+    const auto opts = parse_args(argc, argv);
+    if(!opts.first) {
+        usage(argv[0]);
         return -1;
+    }
 
     struct sigaction sa;
     sigemptyset(&sa.sa_mask);
@@ -418,44 +1543,181 @@ int main(int argc, char *argv[])
     if(sigaction(SIGINT, &sa, NULL) == -1)
         perror("sigaction");
 
-    const std::string name(argv[1]);
-
+    if(opts.second.daemon) {
 #ifdef USE_PROC_CONN
-    // subscribe for events
-    fork_handler_t fork_notify;
-    if(fork_notify.is_ok()) {
-        // check existing processes first
-        if(proc_iterate(name)) {
-            std::cerr << "\n";
-            return 0;
-        }
+        daemon_t daemon(opts.second.socket, opts.second.rcvbuf);
+        if(!daemon.is_ok())
+            return -1;
+        daemon.run();
+        return 0;
+#else
+        std::cerr << "daemon mode needs the proc connector\n";
+        return -1;
+#endif
+    }
+
+    name_set_t names;
+    for(const auto &n: opts.second.names)
+        if(!names.add(n))
+            return -1;
+    for(const auto &f: opts.second.files)
+        if(!names.load(f.c_str()))
+            return -1;
+    if(!names.size())
+        return -1;
+
+    const bool attach = opts.second.stop || !opts.second.exec.empty();
+    const bool follow = opts.second.follow_respawn;
+    // the daemon only knows plain names and answers too late to stop
+    const auto &name = names.specs[0];
+    if(!attach && !opts.second.wait_exit && opts.second.cgroup.empty()
+       && names.size() == 1 && name.find(':') == std::string::npos
+       && daemon_wait(opts.second.socket, name, 20000))
+        return 0;
 
-        for(size_t i = 0; i < 200 && !sigint;) {
-            if(!fork_notify.wait_for(100)) {
-                std::cerr << "." << std::flush;
-                if(!fork_notify.is_ok())
+    proc_scanner_t proc;
+    waiter_t waiter(names, opts.second.wait_all);
+    waiter.stop = opts.second.stop;
+    lifecycle_t life(names.specs);
+    if(opts.second.wait_exit)
+        waiter.life = &life;
+    const auto on_exit = [&waiter, follow](size_t idx) {
+        if(follow)
+            waiter.rearm(idx);
+    };
+    if(attach) {
+        // taken with sigtimedwait in attacher_t, by any thread
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        sigaddset(&set, SIGCHLD);
+        if(sigprocmask(SIG_BLOCK, &set, nullptr) == -1)
+            perror("sigprocmask");
+    }
+    // waits for the commands when main returns
+    attacher_t attacher(opts.second.exec, opts.second.ready_ms);
+    // continues --stop targets even without a command
+    if(attach)
+        waiter.attach = &attacher;
+
+    if(!opts.second.cgroup.empty()) {
+        cgroup_t cgroup(proc, opts.second.cgroup);
+        if(!cgroup.is_ok())
+            return -1;
+        proc_poller_t poller(proc, waiter);
+        auto deadline = proc_poller_t::clock_t::now() + std::chrono::seconds(20);
+        while(!sigint && proc_poller_t::clock_t::now() < deadline) {
+            cgroup.drain();
+            if(poller.pass(cgroup) && waiter.finished())
+                break;
+            // an empty cgroup can not exec, sleep until something moves in
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - proc_poller_t::clock_t::now());
+            const int ms = poller.size() ? poller.interval.count()
+                                         : std::max<int>(left.count(), 0);
+            if(!life.empty()) {
+                life.wait(cgroup.fd, ms, on_exit);
+                deadline = proc_poller_t::clock_t::now() + std::chrono::seconds(20);
+                if(waiter.finished())
                     break;
-                ++i;
-                continue;
+            } else {
+                pollfd pfd = { cgroup.fd, POLLIN, 0 };
+                if(poll(&pfd, 1, ms) == -1 && errno != EINTR) {
+                    perror("poll");
+                    break;
+                }
             }
-            bool have = false;
-            fork_notify.try_rx([&name, &have](pid_t pid, pid_t tgid) {
-                    std::cerr << "pid/tgid: " << pid << "/" << tgid << "\n";
-                    if(check_pid(name, pid))
-                        have = true; });
-            if(have)
-                break;
         }
         std::cerr << "\n";
         return 0;
     }
+
+#ifdef USE_PROC_CONN
+    if(!opts.second.poll) {
+        // subscribe for events, renames via prctl(PR_SET_NAME) are matched
+        // against name in the kernel. With --comm-only exec events are dropped
+        // there as well.
+        std::vector<proc_event_t> events = {proc_event::PROC_EVENT_COMM};
+        if(!opts.second.comm_only)
+            events.push_back(proc_event::PROC_EVENT_EXEC);
+        fork_handler_t fork_notify(events, names.comms(), opts.second.rcvbuf);
+        if(fork_notify.is_ok()) {
+            // check existing processes first
+            if(proc_iterate(proc, waiter) && waiter.finished()) {
+                std::cerr << "\n";
+                return 0;
+            }
+
+            // 20 s without a match, not counting the time a match is alive
+            for(size_t i = 0; i < 200 && !sigint;) {
+                const bool ready = waiter.life && !life.empty()
+                    ? life.wait(fork_notify.fd, 100, on_exit)
+                    : fork_notify.wait_for(100);
+                if(!life.empty())
+                    i = 0;
+                if(waiter.finished())
+                    break;
+                if(!ready) {
+                    if(life.empty())
+                        std::cerr << "." << std::flush;
+                    if(!fork_notify.is_ok())
+                        break;
+                    ++i;
+                    continue;
+                }
+                bool have = false;
+                const auto complete = fork_notify.try_rx(
+                    [&proc, &waiter, &have](const proc_event &ev) {
+                        if(have)
+                            return;
+                        if(ev.what == proc_event::PROC_EVENT_COMM) {
+                            // prefix matched in the kernel if possible
+                            const auto &c = ev.event_data.comm;
+                            have = waiter.check(c.comm, c.process_pid, c.comm,
+                                                ev.timestamp_ns);
+                            return;
+                        }
+                        const auto pid = ev.event_data.exec.process_pid;
+                        const auto tgid = ev.event_data.exec.process_tgid;
+                        std::cerr << "pid/tgid: " << pid << "/" << tgid << "\n";
+                        have = check_pid(proc, waiter, pid, ev.timestamp_ns); });
+                if(!complete && !have) {
+                    // the exec we wait for might be among the lost events
+                    std::cerr << "netlink overflow (" << fork_notify.dropped()
+                              << " messages dropped so far), rescanning /proc\n";
+                    have = proc_iterate(proc, waiter);
+                }
+                if(have && waiter.finished())
+                    break;
+            }
+            std::cerr << "\n";
+            if(fork_notify.overflows)
+                std::cerr << "overflows: " << fork_notify.overflows
+                          << " dropped: " << fork_notify.dropped() << "\n";
+            if(fork_notify.errors)
+                std::cerr << "skipped netlink messages: " << fork_notify.errors
+                          << " (" << strerror(fork_notify.error) << ")\n";
+            return 0;
+        }
+        proc_conn_error(fork_notify);
+    }
 #endif
 
-    for(size_t i = 0; i < 200 && !sigint; i++) {
-        if(proc_iterate(name))
+    proc_poller_t poller(proc, waiter);
+    auto deadline = proc_poller_t::clock_t::now() + std::chrono::seconds(20);
+    while(!sigint && proc_poller_t::clock_t::now() < deadline) {
+        if(poller.pass() && waiter.finished())
             break;
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cerr << "." << std::flush;
+        if(!life.empty()) {
+            life.wait(-1, poller.interval.count(), on_exit);
+            deadline = proc_poller_t::clock_t::now() + std::chrono::seconds(20);
+            if(waiter.finished())
+                break;
+            continue;
+        }
+        std::this_thread::sleep_for(poller.interval);
+        if(poller.interval == proc_poller_t::MAX)
+            std::cerr << "." << std::flush;
     }
     std::cerr << "\n";
 }
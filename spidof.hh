@@ -0,0 +1,762 @@
+/*
+spidof.hh: the process watching parts of spidof for use in other programs.
+Header only, everything is in namespace spidof.
+
+proc_scanner_t and lookup() scan /proc. With USE_PROC_CONN defined (link
+with -lcap), fork_handler_t subscribes to the proc connector. Its socket is
+non-blocking, register fd with epoll and call process() when it is readable:
+
+spidof::fork_handler_t h({proc_event::PROC_EVENT_EXEC,
+                          proc_event::PROC_EVENT_EXIT});
+epoll_ctl(ep, EPOLL_CTL_ADD, h.fd, &ev);
+...
+spidof::callbacks_t cb;
+cb.on_exec = [](const spidof::exec_event_t &e) { ... };
+spidof::process(h, cb);
+
+The binary needs CAP_NET_ADMIN in its permitted set, see get_priv().
+*/
+
+#ifndef SPIDOF_HH
+#define SPIDOF_HH
+
+extern "C" {
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+}
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace spidof {
+
+inline const char *get_basename(const char *filename)
+{
+    const char *result = filename;
+    while(*filename != '\0')
+        if(*(filename++) == '/')
+            result = filename;
+    return result;
+}
+
+// Scans /proc with getdents64 into one buffer and reads /proc/<pid>/ files
+// through openat on the /proc dirfd into another one. Nothing is allocated
+// per pid, which matters with tens of thousands of tasks.
+struct proc_scanner_t {
+    proc_scanner_t()
+        : fd(open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)),
+          dents(1 << 16), file(4096)
+    {
+        if(fd == -1)
+            perror("open /proc");
+    }
+
+    ~proc_scanner_t()
+    {
+        if(fd != -1)
+            close(fd);
+    }
+
+    proc_scanner_t(const proc_scanner_t &) = delete;
+    proc_scanner_t &operator=(const proc_scanner_t &) = delete;
+
+    // Calls cb(pid) for each numeric directory in /proc until cb returns
+    // true. Returns true if cb did.
+    template<typename lambda_t>
+    bool foreach_pid(lambda_t cb)
+    {
+        return foreach_num_dir(fd, [&cb](pid_t pid, ino64_t) {
+                return cb(pid); });
+    }
+
+    // Same with cb(pid, ino). The inode number of /proc/<pid> is assigned
+    // when the directory is instantiated, so a different one means either
+    // a new process with a reused pid or an evicted dentry.
+    template<typename lambda_t>
+    bool foreach_pid_ino(lambda_t cb)
+    {
+        return foreach_num_dir(fd, cb);
+    }
+
+    // Same for the threads in /proc/<pid>/task.
+    template<typename lambda_t>
+    bool foreach_tid(pid_t pid, lambda_t cb)
+    {
+        char path[64];
+        std::snprintf(path, sizeof(path), "%d/task", pid);
+        const int dir = openat(fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dir == -1)
+            return false;
+        const auto ret = foreach_num_dir(dir, [&cb](pid_t pid, ino64_t) {
+                return cb(pid); });
+        close(dir);
+        return ret;
+    }
+
+    template<typename lambda_t>
+    bool foreach_num_dir(int dir, lambda_t cb)
+    {
+        if(dir == -1 || lseek(dir, 0, SEEK_SET) == -1)
+            return false;
+        while(true) {
+            const auto len = syscall(SYS_getdents64, dir, dents.data(), dents.size());
+            if(len == -1) {
+                perror("getdents64");
+                return false;
+            }
+            if(len == 0)
+                return false;
+            for(long off = 0; off < len;) {
+                const auto d = reinterpret_cast<const dirent64 *>(dents.data() + off);
+                off += d->d_reclen;
+                if(d->d_type != DT_DIR && d->d_type != DT_UNKNOWN)
+                    continue;
+                pid_t pid = 0;
+                const char *c = d->d_name;
+                for(; *c >= '0' && *c <= '9'; c++)
+                    pid = pid * 10 + (*c - '0');
+                if(*c != '\0' || pid == 0)
+                    continue;
+                if(cb(pid, d->d_ino))
+                    return true;
+            }
+        }
+    }
+
+    // Reads /proc/<pid>/<name> into the internal buffer and returns it,
+    // NUL terminated. Returns nullptr if the process is gone.
+    const char *read(pid_t pid, const char *name, size_t *size = nullptr)
+    {
+        char path[64];
+        std::snprintf(path, sizeof(path), "%d/%s", pid, name);
+        const int f = openat(fd, path, O_RDONLY | O_CLOEXEC);
+        if(f == -1)
+            return nullptr;
+        const auto len = ::read(f, file.data(), file.size() - 1);
+        close(f);
+        if(len < 0)
+            return nullptr;
+        file[len] = '\0';
+        if(size)
+            *size = len;
+        return file.data();
+    }
+
+    // Field 22 of /proc/<pid>/stat, the start time in clock ticks since
+    // boot. Returns 0 if the process is gone.
+    unsigned long long starttime(pid_t pid)
+    {
+        const char *stat = read(pid, "stat");
+        if(!stat)
+            return 0;
+        // comm may contain spaces and parentheses
+        const char *c = strrchr(stat, ')');
+        for(int field = 2; c && field < 22; field++)
+            c = strchr(c + 1, ' ');
+        return c ? strtoull(c + 1, nullptr, 10) : 0;
+    }
+
+    // Like read() for the symlink /proc/<pid>/<name>.
+    const char *readlink(pid_t pid, const char *name)
+    {
+        char path[64];
+        std::snprintf(path, sizeof(path), "%d/%s", pid, name);
+        const auto len = readlinkat(fd, path, file.data(), file.size() - 1);
+        if(len < 0)
+            return nullptr;
+        file[len] = '\0';
+        return file.data();
+    }
+
+    int fd;
+    std::vector<char> dents;
+    std::vector<char> file;
+};
+
+// Pids of the processes whose argv[0] basename starts with name, like
+// spidof without waiting.
+inline std::vector<pid_t> lookup(proc_scanner_t &proc, const char *name)
+{
+    std::vector<pid_t> ret;
+    const size_t len = strlen(name);
+    proc.foreach_pid([&proc, &ret, name, len](pid_t pid) {
+            const char *cmdline = proc.read(pid, "cmdline");
+            if(cmdline && strncmp(get_basename(cmdline), name, len) == 0)
+                ret.push_back(pid);
+            return false; });
+    return ret;
+}
+
+}
+
+#ifdef USE_PROC_CONN
+// Employ proc connector API to reduce need for polling /proc.
+
+extern "C" {
+#include <linux/cn_proc.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/capability.h>
+}
+
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+
+namespace spidof {
+
+
+// enum proc_event::what, the member of the same name hides the type
+typedef decltype(proc_event::what) proc_event_t;
+
+// Appends a program that accepts the packet if the comm of a
+// PROC_EVENT_COMM for a process (not a thread) starts with one of comms.
+inline void filter_comm(std::vector<struct sock_filter> &f,
+                 const std::vector<std::string> &comms)
+{
+    const __u32 ev = NLMSG_LENGTH(0) + __builtin_offsetof(struct cn_msg, data);
+
+    // pid != tgid: thread was renamed
+    f.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                         ev + __builtin_offsetof(struct proc_event,
+                                                 event_data.comm.process_pid)));
+    f.push_back(BPF_STMT(BPF_ST, 0));
+    f.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                         ev + __builtin_offsetof(struct proc_event,
+                                                 event_data.comm.process_tgid)));
+    f.push_back(BPF_STMT(BPF_LDX | BPF_MEM, 0));
+    f.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_X, 0, 1, 0));
+    f.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+
+    // One compare chain per name. A mismatch jumps to the next chain, so
+    // all jump offsets stay small.
+    const __u32 comm = ev + __builtin_offsetof(struct proc_event,
+                                               event_data.comm.comm);
+    for(const auto &name: comms) {
+        // comm is truncated to 15 chars + '\0'
+        const size_t len = std::min<size_t>(name.length(), 15);
+        // absolute loads are big endian: "abcd" is 0x61626364
+        struct load_t {
+            __u16 size;
+            __u32 off;
+            __u32 k;
+        };
+        std::vector<load_t> loads;
+        for(size_t off = 0; off < len;) {
+            const size_t n = len - off >= 4 ? 4 : len - off >= 2 ? 2 : 1;
+            __u32 k = 0;
+            for(size_t i = 0; i < n; i++)
+                k = k << 8 | (unsigned char)name[off + i];
+            loads.push_back(load_t {__u16(n == 4 ? BPF_W : n == 2 ? BPF_H : BPF_B),
+                                    __u32(comm + off), k});
+            off += n;
+        }
+        const size_t chain = loads.size() * 2 + 1;
+        for(size_t i = 0; i < loads.size(); i++) {
+            f.push_back(BPF_STMT(BPF_LD | loads[i].size | BPF_ABS, loads[i].off));
+            f.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, loads[i].k, 0,
+                                 __u8(chain - (i * 2 + 2))));
+        }
+        f.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+    }
+    f.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+}
+
+// Filter out all non-relevant messages in the kernel. Only proc_events of the
+// given types pass. If comms is not empty, PROC_EVENT_COMM passes only for
+// processes whose new comm starts with one of them.
+//
+// This is generated at runtime. EXEC events can not be filtered by name
+// here: they only carry pid and tgid, the kernel sends no COMM event on exec.
+inline void filter(int sock, const std::vector<proc_event_t> &events,
+            const std::vector<std::string> &comms = {})
+{
+    // return amount of bytes of the packet
+    // context: | struct nlmsghdr | struct cn_msg | struct proc_event ... |
+    std::vector<struct sock_filter> f = {
+        // 1. return all if type != NLMSG_DONE
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+                 __builtin_offsetof(struct nlmsghdr, nlmsg_type)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(NLMSG_DONE), 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+
+        // 2. return all if cn_msg::id::idx != CN_IDX_PROC
+        // load 32bit id from absolute address given in argument
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 // skip nlmsghdr
+                 NLMSG_LENGTH(0)
+                 // add offset to: cn_msg::id::idx
+                 + __builtin_offsetof(struct cn_msg, id)
+                 + __builtin_offsetof(struct cb_id, idx)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(CN_IDX_PROC), 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+
+        // 3. return all if cn_msg::id::val != CN_VAL_PROC
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 NLMSG_LENGTH(0) + __builtin_offsetof(struct cn_msg, id)
+                 + __builtin_offsetof(struct cb_id, val)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(CN_VAL_PROC), 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+
+        // packet contains 1 netlink msg from proc_cn
+
+        // 4. if proc_event type is not in events, throw away packet
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 NLMSG_LENGTH(0) + __builtin_offsetof(struct cn_msg, data)
+                 + __builtin_offsetof(struct proc_event, what)),
+    };
+    std::vector<proc_event_t> plain;
+    bool comm = false;
+    for(const auto ev: events) {
+        if(ev == proc_event::PROC_EVENT_COMM && !comms.empty())
+            comm = true;
+        else
+            plain.push_back(ev);
+    }
+    for(size_t i = 0; i < plain.size(); i++)
+        // jump over remaining compares and the drop statement
+        f.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(plain[i]),
+                             __u8(plain.size() - i + comm), 0));
+    // 5. PROC_EVENT_COMM: jump over drop and accept to the comm compare
+    if(comm)
+        f.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                             htonl(proc_event::PROC_EVENT_COMM), 2, 0));
+    f.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+    f.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+    if(comm)
+        filter_comm(f, comms);
+
+    struct sock_fprog fprog;
+    fprog.filter = f.data();
+    fprog.len = f.size();
+    if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof fprog) == -1)
+        perror("setsockopt");
+}
+
+// The capability helpers print nothing. On failure they return false with
+// errno set by libcap, or EINVAL if the kernel does not know
+// CAP_NET_ADMIN and EPERM if it is not in the permitted set (run
+// setcap CAP_NET_ADMIN=p <binary>).
+inline bool cap_set_if_not(cap_t caps, cap_flag_value_t val, cap_value_t *list, size_t size)
+{
+    cap_flag_value_t flag;
+    if(cap_get_flag(caps, list[0], CAP_EFFECTIVE, &flag) == -1)
+        return false;
+    if(flag != val
+       && (cap_set_flag(caps, CAP_EFFECTIVE, size, list, val) == -1
+           || cap_set_proc(caps) == -1))
+        return false;
+    return true;
+}
+
+// Test if CAP_NET_ADMIN is effective, else make it effective
+inline bool get_priv()
+{
+    cap_value_t cap_list[1] = { CAP_NET_ADMIN };
+    if(!CAP_IS_SUPPORTED(CAP_NET_ADMIN)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    cap_t caps = cap_get_proc();
+    if(caps == NULL)
+        return false;
+
+    // Ensure that CAP_NET_ADMIN is permitted
+    bool ret = false;
+    cap_flag_value_t flag;
+    if(cap_get_flag(caps, cap_list[0], CAP_PERMITTED, &flag) == 0) {
+        if(flag == CAP_SET)
+            ret = cap_set_if_not(caps, CAP_SET, cap_list, 1);
+        else
+            errno = EPERM;
+    }
+    // cap_free() may change errno
+    const int err = errno;
+    cap_free(caps);
+    errno = err;
+    return ret;
+}
+
+// Drop CAP_NET_ADMIN to permitted if effective
+inline bool drop_priv()
+{
+    cap_value_t cap_list[1] = { CAP_NET_ADMIN };
+    auto caps = cap_get_proc();
+    if(caps == NULL)
+        return false;
+    const auto ret = cap_set_if_not(caps, CAP_CLEAR, cap_list, 1);
+    const int err = errno;
+    cap_free(caps);
+    errno = err;
+    return ret;
+}
+
+struct fork_handler_t {
+    explicit fork_handler_t(const std::vector<proc_event_t> &events
+                            = {proc_event::PROC_EVENT_EXEC},
+                            const std::vector<std::string> &comms = {},
+                            int rcvbuf = 0)
+        : fd(-1), total(0), ok(0), overflows(0), errors(0), error(0),
+          init_error(0)
+    {
+        if(!get_priv()) {
+            init_error = errno;
+            return;
+        }
+        fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_CONNECTOR);
+        if(fd == -1) {
+            init_error = errno;
+            return;
+        }
+
+        addr.nl_family = AF_NETLINK;
+        addr.nl_pid = getpid();
+        addr.nl_groups = CN_IDX_PROC;
+
+        auto err = bind(fd, (struct sockaddr *)&addr, sizeof addr);
+        if(err == -1) {
+            init_error = errno;
+            close(fd);
+            fd = -1;
+            return;
+        }
+
+        filter(fd, events, comms);
+        // while CAP_NET_ADMIN is still effective
+        if(rcvbuf > 0)
+            set_rcvbuf(rcvbuf);
+
+        { // send subscription message
+            char nlmsghdrbuf[NLMSG_LENGTH(0)];
+            nlmsghdr *nlmsghdr = reinterpret_cast<struct nlmsghdr *>(nlmsghdrbuf);
+
+            nlmsghdr->nlmsg_len = NLMSG_LENGTH(sizeof(cn_msg) + sizeof(proc_cn_mcast_op));
+            nlmsghdr->nlmsg_type = NLMSG_DONE;
+            nlmsghdr->nlmsg_flags = 0;
+            nlmsghdr->nlmsg_seq = 0;
+            nlmsghdr->nlmsg_pid = getpid();
+
+            struct cn_msg cn_msg;
+            enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+            cn_msg.id.idx = CN_IDX_PROC;
+            cn_msg.id.val = CN_VAL_PROC;
+            cn_msg.seq = 0;
+            cn_msg.ack = 0;
+            cn_msg.len = sizeof op;
+
+            struct iovec iov[3];
+            iov[0].iov_base = nlmsghdrbuf;
+            iov[0].iov_len = NLMSG_LENGTH(0);
+            iov[1].iov_base = &cn_msg;
+            iov[1].iov_len = sizeof cn_msg;
+            iov[2].iov_base = &op;
+            iov[2].iov_len = sizeof op;
+
+            // the socket is non-blocking, wait a bit if it is full
+            ssize_t tx;
+            while((tx = writev(fd, iov, 3)) == -1) {
+                if(errno == EINTR)
+                    continue;
+                pollfd pfd = { fd, POLLOUT, 0 };
+                if(errno != EAGAIN || poll(&pfd, 1, 1000) != 1)
+                    break;
+            }
+            if(tx == -1) {
+                init_error = errno;
+                close(fd);
+                fd = -1;
+                return;
+            }
+            if(size_t(tx) != iov[0].iov_len + iov[1].iov_len + iov[2].iov_len) {
+                init_error = EIO;
+                close(fd);
+                fd = -1;
+                return;
+            }
+        }
+        // If capabilites are dropped before sending the subscription
+        // message leads to strange behavior: no messages will be
+        // received until subscription message is sent once with
+        // uid=0.
+        drop_priv();
+
+        // ring of page sized buffers for recvmmsg
+        enum { RING = 64 };
+        buf.resize(RING * getpagesize());
+        msgs.resize(RING);
+        iovs.resize(RING);
+        addrs.resize(RING);
+        for(size_t i = 0; i < RING; i++) {
+            iovs[i].iov_base = &buf[i * getpagesize()];
+            iovs[i].iov_len = getpagesize();
+            memset(&msgs[i], 0, sizeof msgs[i]);
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    ~fork_handler_t()
+    {
+        if(fd != -1)
+            close(fd);
+    }
+
+    bool is_ok() const { return fd != -1; }
+
+    bool wait_for(size_t ms_timeout)
+    {
+        pollfd pfd[1];
+        pfd[0].events = POLLIN;
+        pfd[0].fd = fd;
+        const auto mux = poll(pfd, 1, ms_timeout);
+        if(mux == -1) {
+            perror("poll");
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        return mux > 0;
+    }
+
+    // Calls cb(const proc_event &) for each received event. Drains the
+    // socket with recvmmsg, at most MAX_BATCHES * RING messages per call to
+    // stay responsive during bursts. Returns false if the socket buffer
+    // overflowed and events were lost.
+    template<typename lambda_t>
+    bool try_rx(lambda_t cb)
+    {
+        enum { MAX_BATCHES = 16 };
+        bool overflow = false;
+        for(size_t batch = 0; batch < MAX_BATCHES; batch++) {
+            for(auto &m: msgs)
+                m.msg_hdr.msg_namelen = sizeof(sockaddr_nl);
+
+            // read: | nlmsghdr | cn_msg | proc_event ... | per message
+            const auto n = recvmmsg(fd, msgs.data(), msgs.size(), MSG_DONTWAIT,
+                                    nullptr);
+            if(n == -1) {
+                if(errno == ENOBUFS) {
+                    // error is cleared, queued messages are still there
+                    overflows++;
+                    overflow = true;
+                    continue;
+                }
+                if(errno == EINTR)
+                    continue;
+                if(errno != EAGAIN)
+                    perror("recvmmsg");
+                break;
+            }
+
+            for(int i = 0; i < n; i++) {
+                // from kernel?
+                if(addrs[i].nl_pid != 0)
+                    continue;
+                dispatch(&buf[i * getpagesize()], msgs[i].msg_len, cb);
+            }
+            if(size_t(n) < msgs.size())
+                break;
+        }
+        return !overflow;
+    }
+
+    template<typename lambda_t>
+    void dispatch(char *data, ssize_t len, lambda_t &cb)
+    {
+        for(nlmsghdr *nlhdr = (nlmsghdr *)data; NLMSG_OK(nlhdr, len);
+            nlhdr = NLMSG_NEXT(nlhdr, len)) {
+            total++;
+            if(nlhdr->nlmsg_type == NLMSG_NOOP)
+                continue;
+            if(nlhdr->nlmsg_type == NLMSG_ERROR) {
+                const auto err = (const nlmsgerr *)NLMSG_DATA(nlhdr);
+                // error 0 is an ack
+                if(nlhdr->nlmsg_len < NLMSG_LENGTH(sizeof *err) || err->error)
+                    fail(nlhdr->nlmsg_len < NLMSG_LENGTH(sizeof *err)
+                         ? EPROTO : -err->error);
+                continue;
+            }
+            struct cn_msg *cn_msg = (struct cn_msg *)NLMSG_DATA(nlhdr);
+            if(nlhdr->nlmsg_len < NLMSG_LENGTH(sizeof *cn_msg
+                                               + sizeof(proc_event))
+               || cn_msg->id.idx != CN_IDX_PROC
+               || cn_msg->id.val != CN_VAL_PROC) {
+                fail(EPROTO);
+                continue;
+            }
+            ok++;
+
+            cb(*(struct proc_event *)cn_msg->data);
+        }
+    }
+
+    // Counts a message that is no proc event.
+    void fail(int err)
+    {
+        errors++;
+        error = err;
+    }
+
+    // Messages the kernel dropped for this socket because the receive
+    // buffer was full: "Drops" column of /proc/net/netlink.
+    size_t dropped() const
+    {
+        struct stat st;
+        if(fstat(fd, &st) == -1)
+            return 0;
+        FILE *f = fopen("/proc/net/netlink", "re");
+        if(!f)
+            return 0;
+        char line[256];
+        unsigned long drops = 0, inode = 0;
+        size_t ret = 0;
+        while(fgets(line, sizeof line, f))
+            if(sscanf(line, "%*x %*d %*u %*x %*d %*d %*d %*d %lu %lu",
+                      &drops, &inode) == 2
+               && inode == st.st_ino) {
+                ret = drops;
+                break;
+            }
+        fclose(f);
+        return ret;
+    }
+
+    // Larger receive buffer for bursts of execs. SO_RCVBUFFORCE ignores
+    // net.core.rmem_max but needs CAP_NET_ADMIN.
+    void set_rcvbuf(int size)
+    {
+        if(setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size) == -1
+           && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size) == -1)
+            perror("setsockopt SO_RCVBUF");
+    }
+
+    int fd;
+    size_t total;
+    size_t ok;
+    size_t overflows;
+    // Messages that were skipped: an NLMSG_ERROR, or not a proc event.
+    // error is the errno of the last one, EPROTO if it was malformed.
+    size_t errors;
+    int error;
+    // errno of the failed setup step when !is_ok(), the constructor does
+    // not print. EPERM: CAP_NET_ADMIN is not permitted, see get_priv().
+    int init_error;
+    struct sockaddr_nl addr;
+    std::vector<char> buf;
+    std::vector<mmsghdr> msgs;
+    std::vector<iovec> iovs;
+    std::vector<sockaddr_nl> addrs;
+};
+
+
+// Typed views of the events fork_handler_t receives, for process(). They
+// are filled from the proc_event in the receive buffer, comm points into
+// that buffer and is only valid during the callback.
+struct fork_event_t {
+    pid_t parent_pid;
+    pid_t parent_tgid;
+    pid_t child_pid;
+    pid_t child_tgid;
+    uint64_t timestamp_ns;
+};
+
+struct exec_event_t {
+    pid_t pid;
+    pid_t tgid;
+    uint64_t timestamp_ns;
+};
+
+struct comm_event_t {
+    pid_t pid;
+    pid_t tgid;
+    const char *comm;
+    uint64_t timestamp_ns;
+};
+
+struct exit_event_t {
+    pid_t pid;
+    pid_t tgid;
+    uint32_t exit_code;
+    uint32_t exit_signal;
+    uint64_t timestamp_ns;
+};
+
+// Callbacks for process(). Unset ones are skipped. on_overflow is called
+// when events were lost, a caller keeping state should rescan /proc then.
+// on_error(errno) is called when messages had to be skipped, see
+// fork_handler_t::errors.
+struct callbacks_t {
+    std::function<void(const fork_event_t &)> on_fork;
+    std::function<void(const exec_event_t &)> on_exec;
+    std::function<void(const comm_event_t &)> on_comm;
+    std::function<void(const exit_event_t &)> on_exit;
+    std::function<void()> on_overflow;
+    std::function<void(int)> on_error;
+};
+
+// Drains the socket of h and calls the matching callback for each event.
+// Meant to be called when h.fd is readable. Returns false if events were
+// lost.
+inline bool process(fork_handler_t &h, const callbacks_t &cb)
+{
+    const auto errors = h.errors;
+    const auto complete = h.try_rx([&cb](const proc_event &ev) {
+            const auto &d = ev.event_data;
+            switch(ev.what) {
+            case proc_event::PROC_EVENT_FORK:
+                if(cb.on_fork)
+                    cb.on_fork(fork_event_t{d.fork.parent_pid, d.fork.parent_tgid,
+                                            d.fork.child_pid, d.fork.child_tgid,
+                                            ev.timestamp_ns});
+                break;
+            case proc_event::PROC_EVENT_EXEC:
+                if(cb.on_exec)
+                    cb.on_exec(exec_event_t{d.exec.process_pid,
+                                            d.exec.process_tgid,
+                                            ev.timestamp_ns});
+                break;
+            case proc_event::PROC_EVENT_COMM:
+                if(cb.on_comm)
+                    cb.on_comm(comm_event_t{d.comm.process_pid,
+                                            d.comm.process_tgid,
+                                            d.comm.comm, ev.timestamp_ns});
+                break;
+            case proc_event::PROC_EVENT_EXIT:
+                if(cb.on_exit)
+                    cb.on_exit(exit_event_t{d.exit.process_pid,
+                                            d.exit.process_tgid,
+                                            d.exit.exit_code,
+                                            d.exit.exit_signal,
+                                            ev.timestamp_ns});
+                break;
+            default:
+                break;
+            } });
+    if(h.errors != errors && cb.on_error)
+        cb.on_error(h.error);
+    if(!complete && cb.on_overflow)
+        cb.on_overflow();
+    return complete;
+}
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,304 @@
+/*
+Detection latency and CPU cost of spidof under an exec storm.
+
+A storm process posix_spawns /bin/true at --rate per second. For each run
+spidof is started, given --settle ms to subscribe and scan /proc, then the
+target is spawned at a known CLOCK_MONOTONIC time. Latency is the time
+until spidof prints the pid, CPU time is what spidof used from start to
+exit, storm included.
+
+Modes:
+netlink  exec events from the proc connector, target found by argv[0]
+poll     spidof --poll, incremental /proc polling
+bpf      spidof --comm-only, the target renames itself with prctl and the
+         kernel drops everything else. Latency counts from the rename.
+
+Usage example:
+make spidof spidof_bench
+sudo ./spidof_bench --rate 2000 --runs 20 --spidof ./spidof
+*/
+
+extern "C" {
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+const char TARGET[] = "spidof_bench_t";
+
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// args[0] is only argv[0], path is executed
+pid_t spawn(const char *path, const std::vector<const char *> &args,
+            posix_spawn_file_actions_t *actions = nullptr)
+{
+    std::vector<char *> argv;
+    for(const auto a: args)
+        argv.push_back(const_cast<char *>(a));
+    argv.push_back(nullptr);
+    pid_t pid;
+    const int err = posix_spawn(&pid, path, actions, nullptr, argv.data(),
+                                environ);
+    if(err) {
+        std::cerr << "posix_spawn " << path << ": " << strerror(err) << "\n";
+        return -1;
+    }
+    return pid;
+}
+
+// Forks a process spawning /bin/true rate times per second until killed.
+// Children are reaped by the kernel. rate 0: no storm.
+pid_t start_storm(unsigned rate)
+{
+    if(!rate)
+        return 0;
+    const pid_t pid = fork();
+    if(pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if(pid)
+        return pid;
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    signal(SIGCHLD, SIG_IGN);
+    const uint64_t step = 1000000000ull / rate;
+    uint64_t due = monotonic_ns();
+    while(true) {
+        due += step;
+        spawn("/bin/true", {"true"});
+        struct timespec ts = { time_t(due / 1000000000),
+                               long(due % 1000000000) };
+        // behind schedule: spawn again right away
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+    }
+}
+
+struct result_t {
+    uint64_t latency_ns;
+    uint64_t cpu_ns;
+    uint64_t wall_ns;
+};
+
+// One run of spidof in the given mode. Returns false if spidof did not
+// report the target.
+bool run_once(const std::string &spidof, const std::string &mode,
+              const std::string &self, unsigned settle_ms, result_t &res)
+{
+    int out[2];
+    if(pipe2(out, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return false;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    std::vector<const char *> args = { spidof.c_str() };
+    if(mode == "poll")
+        args.push_back("--poll");
+    else if(mode == "bpf")
+        args.push_back("--comm-only");
+    args.push_back(TARGET);
+
+    const auto t_start = monotonic_ns();
+    const pid_t sp = spawn(spidof.c_str(), args, &actions);
+    posix_spawn_file_actions_destroy(&actions);
+    close(out[1]);
+    if(sp == -1) {
+        close(out[0]);
+        return false;
+    }
+
+    // bpf: the target renames itself when it reads from go, its exec is
+    // not seen. Started before, so t0 does not include its startup.
+    int go[2] = { -1, -1 };
+    pid_t target = -1;
+    if(mode == "bpf") {
+        if(pipe2(go, O_CLOEXEC) == -1) {
+            perror("pipe2");
+        } else {
+            posix_spawn_file_actions_init(&actions);
+            posix_spawn_file_actions_adddup2(&actions, go[0], STDIN_FILENO);
+            target = spawn(self.c_str(), {"spidof_bench", "--target"},
+                           &actions);
+            posix_spawn_file_actions_destroy(&actions);
+            close(go[0]);
+        }
+    }
+    usleep(settle_ms * 1000);
+
+    const auto t0 = monotonic_ns();
+    if(mode == "bpf") {
+        if(go[1] != -1 && write(go[1], "", 1) != 1)
+            perror("write");
+    } else {
+        target = spawn("/bin/sleep", {TARGET, "1"});
+    }
+
+    char line[64];
+    ssize_t len = 0;
+    pollfd pfd = { out[0], POLLIN, 0 };
+    if(poll(&pfd, 1, 5000) == 1)
+        len = read(out[0], line, sizeof line - 1);
+    const auto t1 = monotonic_ns();
+    close(out[0]);
+    if(go[1] != -1)
+        close(go[1]);
+
+    bool ok = len > 0;
+    if(ok) {
+        line[len] = '\0';
+        ok = atoi(line) == target;
+    }
+
+    kill(sp, SIGINT);
+    int status;
+    struct rusage ru;
+    wait4(sp, &status, 0, &ru);
+    res.wall_ns = monotonic_ns() - t_start;
+    if(target > 0) {
+        kill(target, SIGKILL);
+        waitpid(target, &status, 0);
+    }
+
+    res.latency_ns = t1 - t0;
+    res.cpu_ns = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull
+        + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+    return ok;
+}
+
+// nearest rank, v sorted
+uint64_t percentile(const std::vector<uint64_t> &v, unsigned p)
+{
+    if(v.empty())
+        return 0;
+    const size_t rank = (p * v.size() + 99) / 100;
+    return v[rank ? rank - 1 : 0];
+}
+
+struct opt_t {
+    std::string spidof {"./spidof"};
+    std::vector<std::string> modes {"netlink", "poll", "bpf"};
+    unsigned rate {1000};
+    unsigned runs {10};
+    unsigned settle_ms {300};
+};
+
+void usage(const char *arg0)
+{
+    std::cerr << "Usage: " << arg0 << " [--spidof <path>] [--rate <execs/s>]"
+                 " [--runs <n>] [--settle <ms>] [--mode netlink|poll|bpf]...\n";
+}
+
+std::pair<bool, opt_t> parse_args(int argc, char *argv[])
+{
+    opt_t ret;
+    bool modes = false;
+    for(int i = 1; i < argc; i++) {
+        const bool last = i + 1 >= argc;
+        if(strcmp(argv[i], "--spidof") == 0 && !last) {
+            ret.spidof.assign(argv[++i]);
+        } else if(strcmp(argv[i], "--rate") == 0 && !last) {
+            ret.rate = std::atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--runs") == 0 && !last) {
+            ret.runs = std::atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--settle") == 0 && !last) {
+            ret.settle_ms = std::atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--mode") == 0 && !last) {
+            if(!modes)
+                ret.modes.clear();
+            modes = true;
+            ret.modes.push_back(argv[++i]);
+        } else {
+            return std::make_pair(false, ret);
+        }
+    }
+    for(const auto &m: ret.modes)
+        if(m != "netlink" && m != "poll" && m != "bpf")
+            return std::make_pair(false, ret);
+    return std::make_pair(ret.runs > 0, ret);
+}
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc == 2 && strcmp(argv[1], "--target") == 0) {
+        char c;
+        if(read(STDIN_FILENO, &c, 1) != 1)
+            return -1;
+        prctl(PR_SET_NAME, TARGET);
+        sleep(1);
+        return 0;
+    }
+
+    const auto opts = parse_args(argc, argv);
+    if(!opts.first) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    char self[4096];
+    const auto len = readlink("/proc/self/exe", self, sizeof self - 1);
+    if(len == -1) {
+        perror("readlink /proc/self/exe");
+        return -1;
+    }
+    self[len] = '\0';
+
+    const pid_t storm = start_storm(opts.second.rate);
+    if(storm == -1)
+        return -1;
+
+    printf("%-8s %5s %10s %10s %10s %10s %8s\n", "mode", "ok", "p50 us",
+           "p90 us", "p99 us", "max us", "cpu %");
+    for(const auto &mode: opts.second.modes) {
+        std::vector<uint64_t> lat;
+        uint64_t cpu = 0, wall = 0;
+        for(unsigned i = 0; i < opts.second.runs; i++) {
+            // zero if spidof could not be started
+            result_t r {};
+            if(run_once(opts.second.spidof, mode, self, opts.second.settle_ms, r))
+                lat.push_back(r.latency_ns);
+            cpu += r.cpu_ns;
+            wall += r.wall_ns;
+        }
+        std::sort(lat.begin(), lat.end());
+        printf("%-8s %2zu/%-2u %10.1f %10.1f %10.1f %10.1f %8.2f\n",
+               mode.c_str(), lat.size(), opts.second.runs,
+               percentile(lat, 50) / 1e3, percentile(lat, 90) / 1e3,
+               percentile(lat, 99) / 1e3, lat.empty() ? 0 : lat.back() / 1e3,
+               wall ? 100.0 * cpu / wall : 0);
+        fflush(stdout);
+    }
+
+    if(storm > 0) {
+        kill(storm, SIGKILL);
+        waitpid(storm, nullptr, 0);
+    }
+    return 0;
+}